@@ -0,0 +1,354 @@
+// Ephemeris.hpp
+// Batched orbital model for the bodies of the solar system.
+// Orbital parameters are stored as structure-of-arrays so that the positions and
+// rotations of the whole catalog are built in a single SIMD pass. Positions are
+// relative to the body orbited; the hierarchy itself is resolved by the SceneGraph.
+//
+// The orbital and spin phases are kept as unit rotors (cos, sin) that are advanced
+// incrementally every frame, so the per-frame pass needs no trigonometry. The
+// simulation time is a double; the rotors are renormalized periodically and one
+// block of bodies per frame is re-seeded from the closed form, which keeps the
+// error against the exact phase bounded during arbitrarily long runs.
+//
+// In Keplerian mode the revolution rotor is the mean anomaly M of an elliptical
+// orbit. Kepler's equation E - e sin(E) = M is solved for the offset E - M with a
+// fixed number of Newton iterations over the SIMD lanes, and the position is built
+// from the perifocal axes precomputed from the argument of periapsis, inclination
+// and longitude of the ascending node.
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <glm/glm.hpp>
+#include "Simd.hpp"
+
+struct EphemerisBatch {
+    // Rotors are renormalized every this many steps
+    static const int RENORMALIZE_INTERVAL = 16;
+    // Largest per-step angle handled by the series, bigger steps are halved first
+    static constexpr float MAX_STEP_ANGLE = 0.5f;
+    // Steps bigger than this many halvings re-seed everything from the closed form
+    static const int MAX_HALVINGS = 10;
+    // Newton iterations for Kepler's equation, enough for float precision up to e = 0.9
+    static const int KEPLER_ITERATIONS = 4;
+
+    // Number of bodies in the batch (arrays are padded to a multiple of simd::WIDTH)
+    int count = 0;
+
+    // Simulation time the rotors refer to
+    double time = 0.0;
+
+    // Elliptical orbits instead of the circular ones
+    bool keplerian = false;
+
+    // Orbital and rotational parameters, one array per property
+    std::vector<float> orbitRadius;
+    std::vector<float> revolutionSpeed;
+    std::vector<float> rotationSpeed;
+    std::vector<float> sinInclination;
+    std::vector<float> cosInclination;
+    std::vector<float> sinTilt;
+    std::vector<float> cosTilt;
+    std::vector<float> scale;
+
+    // Keplerian elements: eccentricity and the perifocal axes in world space,
+    // scaled by the semi-major and semi-minor axis
+    std::vector<float> eccentricity;
+    std::vector<float> periX, periY, periZ;
+    std::vector<float> normX, normY, normZ;
+
+    // Current orbital and spin phases as unit rotors
+    std::vector<float> cosRev, sinRev, cosSpin, sinSpin;
+
+    // Output of the last pass: positions and rotation-scale columns
+    std::vector<float> posX, posY, posZ;
+    std::vector<float> m00, m01, m02, m10, m11, m20, m21, m22;
+
+    float maxSpeed = 0.0f;
+    int steps = 0;
+    int resyncBlock = 0;
+
+    int addBody(float orbitRadius, float revolutionSpeed, float rotationSpeed,
+        float eclipticInclination, float axialTilt, float scale,
+        float eccentricity = 0.0f, float argumentOfPeriapsis = 0.0f, float ascendingNode = 0.0f);
+    void setTime(double t);
+    void advanceTo(double t);
+    void setPhase(float turns);
+    void computePositions();
+    void computeRotations();
+    void computeTransforms();
+    glm::vec3 position(int i) const;
+    glm::mat4 orbitTransform(int i) const;
+    glm::mat4 bodyTransform(int i) const;
+    glm::vec3 orbitNormal(int i) const;
+
+    void seedBlock(int b);
+    void renormalize();
+};
+
+
+inline int EphemerisBatch::addBody(float radius, float revSpeed, float rotSpeed,
+    float eclipticInclination, float axialTilt, float bodyScale,
+    float e, float argumentOfPeriapsis, float ascendingNode) {
+    if (e < 0.0f || e > 0.9f) {
+        throw std::runtime_error("Ephemeris only supports eccentricities between 0 and 0.9");
+    }
+
+    int i = count++;
+    size_t padded = simd::padToWidth(count);
+    for (std::vector<float>* a : { &orbitRadius, &revolutionSpeed, &rotationSpeed,
+        &sinInclination, &cosInclination, &sinTilt, &cosTilt, &scale,
+        &eccentricity, &periX, &periY, &periZ, &normX, &normY, &normZ,
+        &sinRev, &sinSpin,
+        &posX, &posY, &posZ, &m00, &m01, &m02, &m10, &m11, &m20, &m21, &m22 }) {
+        a->resize(padded, 0.0f);
+    }
+    cosRev.resize(padded, 1.0f);
+    cosSpin.resize(padded, 1.0f);
+
+    orbitRadius[i] = radius;
+    revolutionSpeed[i] = revSpeed;
+    rotationSpeed[i] = rotSpeed;
+    sinInclination[i] = sin(eclipticInclination);
+    cosInclination[i] = cos(eclipticInclination);
+    sinTilt[i] = sin(axialTilt);
+    cosTilt[i] = cos(axialTilt);
+    scale[i] = bodyScale;
+
+    // Perifocal axes P (towards periapsis) and Q, rotated by Rz(node) Rx(incl) Rz(periapsis)
+    // in the ecliptic frame and mapped to the y-up world frame as (x, z, y). With all
+    // angles but the inclination zero this is the same plane as the circular orbit.
+    float so = sin(argumentOfPeriapsis), co = cos(argumentOfPeriapsis);
+    float sn = sin(ascendingNode), cn = cos(ascendingNode);
+    float si = sinInclination[i], ci = cosInclination[i];
+    float b = radius * std::sqrt(1.0f - e * e);
+    eccentricity[i] = e;
+    periX[i] = radius * (cn * co - sn * so * ci);
+    periY[i] = radius * (so * si);
+    periZ[i] = radius * (sn * co + cn * so * ci);
+    normX[i] = b * (-cn * so - sn * co * ci);
+    normY[i] = b * (co * si);
+    normZ[i] = b * (-sn * so + cn * co * ci);
+
+    maxSpeed = std::max(maxSpeed, std::max(std::fabs(revSpeed), std::fabs(rotSpeed)));
+    seedBlock(i - i % simd::WIDTH);
+    return i;
+}
+
+// Sets the rotors of four bodies from the closed form at the current time.
+// Phases are reduced in double precision so they stay exact for long runs.
+inline void EphemerisBatch::seedBlock(int b) {
+    using namespace simd;
+    const double twoPi = 6.283185307179586;
+    float rev[WIDTH], spin[WIDTH];
+    for (int l = 0; l < WIDTH; l++) {
+        rev[l] = (float)std::fmod((double)revolutionSpeed[b + l] * time, twoPi);
+        spin[l] = (float)std::fmod((double)rotationSpeed[b + l] * time, twoPi);
+    }
+
+    f32x4 s, c;
+    sincos(load(rev), s, c);
+    store(&sinRev[b], s);
+    store(&cosRev[b], c);
+    sincos(load(spin), s, c);
+    store(&sinSpin[b], s);
+    store(&cosSpin[b], c);
+}
+
+inline void EphemerisBatch::setTime(double t) {
+    time = t;
+    for (int b = 0; b < count; b += simd::WIDTH) {
+        seedBlock(b);
+    }
+}
+
+// First order correction towards unit length, enough for the tiny drift of a few steps
+inline void renormalizeRotors(float* c, float* s) {
+    using namespace simd;
+    f32x4 cv = load(c), sv = load(s);
+    f32x4 n = set1(1.5f) - set1(0.5f) * (cv * cv + sv * sv);
+    store(c, cv * n);
+    store(s, sv * n);
+}
+
+inline void EphemerisBatch::renormalize() {
+    for (int b = 0; b < count; b += simd::WIDTH) {
+        renormalizeRotors(&cosRev[b], &sinRev[b]);
+        renormalizeRotors(&cosSpin[b], &sinSpin[b]);
+    }
+}
+
+// Rotates (c, s) by the angle d, using a short series for cos(d) and sin(d)
+// and 'halvings' angle doublings to extend it to larger steps
+inline void rotateRotors(simd::f32x4& c, simd::f32x4& s, simd::f32x4 d, int halvings) {
+    using namespace simd;
+    f32x4 d2 = d * d;
+    f32x4 one = set1(1.0f);
+    f32x4 sd = d * (one - d2 * set1(1.0f / 6.0f) * (one - d2 * set1(1.0f / 20.0f) * (one - d2 * set1(1.0f / 42.0f))));
+    f32x4 cd = one - d2 * set1(0.5f) * (one - d2 * set1(1.0f / 12.0f) * (one - d2 * set1(1.0f / 30.0f) * (one - d2 * set1(1.0f / 56.0f))));
+    for (int k = 0; k < halvings; k++) {
+        f32x4 c2 = cd * cd - sd * sd;
+        sd = set1(2.0f) * cd * sd;
+        cd = c2;
+    }
+
+    f32x4 cn = c * cd - s * sd;
+    s = s * cd + c * sd;
+    c = cn;
+}
+
+// Moves the simulation to time t by rotating every phase by speed * (t - time)
+inline void EphemerisBatch::advanceTo(double t) {
+    using namespace simd;
+    float dt = (float)(t - time);
+    time = t;
+
+    int halvings = 0;
+    float maxStep = maxSpeed * std::fabs(dt);
+    while (maxStep > MAX_STEP_ANGLE && halvings <= MAX_HALVINGS) {
+        maxStep *= 0.5f;
+        halvings++;
+    }
+    if (halvings > MAX_HALVINGS) {
+        setTime(t);
+        return;
+    }
+
+    const f32x4 h = set1(std::ldexp(dt, -halvings));
+    for (int b = 0; b < count; b += WIDTH) {
+        f32x4 c = load(&cosRev[b]), s = load(&sinRev[b]);
+        rotateRotors(c, s, load(&revolutionSpeed[b]) * h, halvings);
+        store(&cosRev[b], c);
+        store(&sinRev[b], s);
+
+        c = load(&cosSpin[b]);
+        s = load(&sinSpin[b]);
+        rotateRotors(c, s, load(&rotationSpeed[b]) * h, halvings);
+        store(&cosSpin[b], c);
+        store(&sinSpin[b], s);
+    }
+
+    if (++steps % RENORMALIZE_INTERVAL == 0) {
+        renormalize();
+    }
+
+    // Re-seed one block per step from the closed form, round robin
+    if (count > 0) {
+        seedBlock(resyncBlock);
+        resyncBlock += WIDTH;
+        if (resyncBlock >= count) {
+            resyncBlock = 0;
+        }
+    }
+}
+
+// Puts every body the same fraction of a revolution past its periapsis (or its starting
+// point on a circular orbit), regardless of its period. Spin phases are left untouched.
+inline void EphemerisBatch::setPhase(float turns) {
+    float angle = 6.283185307179586f * turns;
+    std::fill(cosRev.begin(), cosRev.end(), std::cos(angle));
+    std::fill(sinRev.begin(), sinRev.end(), std::sin(angle));
+}
+
+// Positions relative to the parent body, from the revolution rotors
+inline void EphemerisBatch::computePositions() {
+    using namespace simd;
+
+    if (!keplerian) {
+        for (int b = 0; b < count; b += WIDTH) {
+            // Position on the inclined circular orbit
+            f32x4 sr = load(&sinRev[b]), cr = load(&cosRev[b]);
+            f32x4 r = load(&orbitRadius[b]);
+            store(&posX[b], cr * r);
+            store(&posY[b], load(&sinInclination[b]) * r * sr);
+            store(&posZ[b], sr * r * load(&cosInclination[b]));
+        }
+        return;
+    }
+
+    const f32x4 one = set1(1.0f);
+    for (int b = 0; b < count; b += WIDTH) {
+        f32x4 sm = load(&sinRev[b]), cm = load(&cosRev[b]);
+        f32x4 e = load(&eccentricity[b]);
+
+        // Newton on f(d) = d - e sin(M + d) for the eccentric anomaly E = M + d,
+        // starting from the first step taken at d = 0
+        f32x4 d = e * sm / (one - e * cm);
+        f32x4 sd, cd, se, ce;
+        for (int k = 0; k < KEPLER_ITERATIONS; k++) {
+            sincos(d, sd, cd);
+            se = sm * cd + cm * sd;
+            ce = cm * cd - sm * sd;
+            d = d - (d - e * se) / (one - e * ce);
+        }
+        sincos(d, sd, cd);
+        se = sm * cd + cm * sd;
+        ce = cm * cd - sm * sd;
+
+        // Position in the orbital plane is (a (cos E - e), b sin E)
+        f32x4 x = ce - e;
+        store(&posX[b], x * load(&periX[b]) + se * load(&normX[b]));
+        store(&posY[b], x * load(&periY[b]) + se * load(&normY[b]));
+        store(&posZ[b], x * load(&periZ[b]) + se * load(&normZ[b]));
+    }
+}
+
+// Each body is placed by Translate(position) * RotZ(axialTilt) * RotY(spin) * Scale; the
+// rotation-scale part is composed directly from the rotors instead of multiplying matrices
+inline void EphemerisBatch::computeTransforms() {
+    computePositions();
+    computeRotations();
+}
+
+inline void EphemerisBatch::computeRotations() {
+    using namespace simd;
+
+    for (int b = 0; b < count; b += WIDTH) {
+        f32x4 ss = load(&sinSpin[b]), cs = load(&cosSpin[b]);
+
+        // Rotation (tilt around z after spin around y) times the uniform scale
+        f32x4 s = load(&scale[b]);
+        f32x4 ct = load(&cosTilt[b]) * s;
+        f32x4 st = load(&sinTilt[b]) * s;
+        store(&m00[b], ct * cs);
+        store(&m01[b], st * cs);
+        store(&m02[b], set1(0.0f) - ss * s);
+        store(&m10[b], set1(0.0f) - st);
+        store(&m11[b], ct);
+        store(&m20[b], ct * ss);
+        store(&m21[b], st * ss);
+        store(&m22[b], cs * s);
+    }
+}
+
+inline glm::vec3 EphemerisBatch::position(int i) const {
+    return glm::vec3(posX[i], posY[i], posZ[i]);
+}
+
+// Translation to the body's position, children of the body inherit only this part
+inline glm::mat4 EphemerisBatch::orbitTransform(int i) const {
+    glm::mat4 M(1.0f);
+    M[3] = glm::vec4(posX[i], posY[i], posZ[i], 1.0f);
+    return M;
+}
+
+// Axial tilt, spin and scale of the body itself
+inline glm::mat4 EphemerisBatch::bodyTransform(int i) const {
+    glm::mat4 M(1.0f);
+    M[0] = glm::vec4(m00[i], m01[i], m02[i], 0.0f);
+    M[1] = glm::vec4(m10[i], m11[i], 0.0f, 0.0f);
+    M[2] = glm::vec4(m20[i], m21[i], m22[i], 0.0f);
+    return M;
+}
+
+// Normal of the orbital plane, oriented along the direction of revolution
+inline glm::vec3 EphemerisBatch::orbitNormal(int i) const {
+    if (!keplerian) {
+        return glm::vec3(0.0f, -cosInclination[i], sinInclination[i]);
+    }
+    return glm::normalize(glm::cross(glm::vec3(periX[i], periY[i], periZ[i]),
+        glm::vec3(normX[i], normY[i], normZ[i])));
+}
@@ -0,0 +1,136 @@
+// EphemerisCache.hpp
+// Keyframed positions of an EphemerisBatch for arbitrary time warps.
+// The orbital elements are fixed, so the position of a body depends only on how far
+// along its revolution it is: the keyframes of each body cover one revolution, which
+// is the time window that repeats forever. They are built once, for circular and
+// Keplerian orbits, by background threads while the renderer keeps evaluating the
+// batch directly. Once ready, a lookup costs one phase reduction and one cubic
+// Hermite interpolation per body, whatever the time step between two frames.
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+#include "Ephemeris.hpp"
+#include "ThreadPool.hpp"
+
+class EphemerisCache {
+public:
+    // Keyframes per revolution, the interpolation error falls with the fourth power of this
+    static const int DEFAULT_KEYFRAMES = 256;
+    // Keyframes evaluated together by one background thread
+    static const int BUILD_GRAIN = 16;
+
+    EphemerisCache() = default;
+    EphemerisCache(const EphemerisCache&) = delete;
+    EphemerisCache& operator=(const EphemerisCache&) = delete;
+
+    ~EphemerisCache() {
+        if (builder.joinable()) {
+            builder.join();
+        }
+    }
+
+    // Starts building the keyframes of a copy of 'source' in the background
+    void build(const EphemerisBatch& source, int keyframesPerRevolution = DEFAULT_KEYFRAMES,
+        unsigned threads = std::thread::hardware_concurrency()) {
+        if (builder.joinable()) {
+            builder.join();
+        }
+        ready = false;
+        keyframes = keyframesPerRevolution;
+        count = source.count;
+        turnsPerTime.resize(count);
+        for (int i = 0; i < count; i++) {
+            turnsPerTime[i] = (double)source.revolutionSpeed[i] / 6.283185307179586;
+        }
+        for (Table& t : tables) {
+            for (std::vector<float>* a : { &t.x, &t.y, &t.z, &t.dx, &t.dy, &t.dz }) {
+                a->assign((size_t)count * keyframes, 0.0f);
+            }
+        }
+
+        builder = std::thread([this, source, threads] {
+            ThreadPool pool(threads);
+            for (int mode = 0; mode < 2; mode++) {
+                fillKeyframes(source, mode == 1, tables[mode], pool);
+            }
+            ready.store(true, std::memory_order_release);
+        });
+    }
+
+    // True once the keyframes are complete and lookups may start
+    bool isReady() const {
+        return ready.load(std::memory_order_acquire);
+    }
+
+    // Writes the positions at time t into batch.posX/Y/Z, as computePositions would
+    void interpolate(EphemerisBatch& batch, double t) const {
+        const Table& table = tables[batch.keplerian ? 1 : 0];
+        for (int i = 0; i < count; i++) {
+            double turns = turnsPerTime[i] * t;
+            float u = (float)((turns - std::floor(turns)) * keyframes);
+            int k = std::min((int)u, keyframes - 1);
+            float f = u - (float)k;
+            size_t k0 = (size_t)i * keyframes + k;
+            size_t k1 = (size_t)i * keyframes + (k + 1 == keyframes ? 0 : k + 1);
+
+            // Cubic Hermite basis on [0, 1]
+            float f2 = f * f, f3 = f2 * f;
+            float h00 = 2.0f * f3 - 3.0f * f2 + 1.0f;
+            float h10 = f3 - 2.0f * f2 + f;
+            float h01 = -2.0f * f3 + 3.0f * f2;
+            float h11 = f3 - f2;
+            batch.posX[i] = h00 * table.x[k0] + h10 * table.dx[k0] + h01 * table.x[k1] + h11 * table.dx[k1];
+            batch.posY[i] = h00 * table.y[k0] + h10 * table.dy[k0] + h01 * table.y[k1] + h11 * table.dy[k1];
+            batch.posZ[i] = h00 * table.z[k0] + h10 * table.dz[k0] + h01 * table.z[k1] + h11 * table.dz[k1];
+        }
+    }
+
+private:
+    // Positions and tangents (per keyframe interval) of every body, body-major
+    struct Table {
+        std::vector<float> x, y, z;
+        std::vector<float> dx, dy, dz;
+    };
+
+    int count = 0;
+    int keyframes = DEFAULT_KEYFRAMES;
+    std::vector<double> turnsPerTime;
+    Table tables[2];    // Circular, Keplerian
+    std::atomic<bool> ready{ false };
+    std::thread builder;
+
+    void fillKeyframes(const EphemerisBatch& source, bool keplerian, Table& table, ThreadPool& pool) {
+        pool.parallelFor(keyframes, BUILD_GRAIN, [&](int begin, int end) {
+            EphemerisBatch batch = source;
+            batch.keplerian = keplerian;
+            for (int k = begin; k < end; k++) {
+                batch.setPhase((float)k / keyframes);
+                batch.computePositions();
+                for (int i = 0; i < count; i++) {
+                    size_t j = (size_t)i * keyframes + k;
+                    table.x[j] = batch.posX[i];
+                    table.y[j] = batch.posY[i];
+                    table.z[j] = batch.posZ[i];
+                }
+            }
+        });
+
+        // Catmull-Rom tangents from the neighbouring keyframes, wrapping around the revolution
+        pool.parallelFor(count, 1, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                size_t base = (size_t)i * keyframes;
+                for (int k = 0; k < keyframes; k++) {
+                    size_t prev = base + (k == 0 ? keyframes - 1 : k - 1);
+                    size_t next = base + (k + 1 == keyframes ? 0 : k + 1);
+                    table.dx[base + k] = 0.5f * (table.x[next] - table.x[prev]);
+                    table.dy[base + k] = 0.5f * (table.y[next] - table.y[prev]);
+                    table.dz[base + k] = 0.5f * (table.z[next] - table.z[prev]);
+                }
+            }
+        });
+    }
+};
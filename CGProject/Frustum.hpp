@@ -0,0 +1,41 @@
+// Frustum.hpp
+// The six planes of a view frustum, extracted from a view-projection matrix with the
+// depth range of Vulkan (0 to 1), and the bounding sphere test used to decide which
+// objects are recorded into a frame's command buffer.
+
+#pragma once
+
+#include <glm/glm.hpp>
+
+struct Frustum {
+    // xyz: inward normal, w: offset; a point p is inside when dot(xyz, p) + w >= 0 for all six
+    glm::vec4 planes[6];
+
+    Frustum() = default;
+
+    explicit Frustum(const glm::mat4& viewProj) {
+        // Rows of the column-major matrix
+        glm::vec4 row[4];
+        for (int i = 0; i < 4; i++) {
+            row[i] = glm::vec4(viewProj[0][i], viewProj[1][i], viewProj[2][i], viewProj[3][i]);
+        }
+        planes[0] = row[3] + row[0];    // Left
+        planes[1] = row[3] - row[0];    // Right
+        planes[2] = row[3] + row[1];    // Top, y is flipped in Vulkan clip space
+        planes[3] = row[3] - row[1];    // Bottom
+        planes[4] = row[2];             // Near, z >= 0
+        planes[5] = row[3] - row[2];    // Far, z <= w
+        for (glm::vec4& p : planes) {
+            p = p / glm::length(glm::vec3(p.x, p.y, p.z));
+        }
+    }
+
+    bool intersectsSphere(const glm::vec3& center, float radius) const {
+        for (const glm::vec4& p : planes) {
+            if (p.x * center.x + p.y * center.y + p.z * center.z + p.w < -radius) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
@@ -0,0 +1,236 @@
+// MemoryAllocator.hpp
+// Suballocates buffers and images from large device memory blocks, so the number of
+// vkAllocateMemory calls stays far below the driver limit however many objects are loaded.
+// Each memory type has two pools of blocks, one for buffers and linear images and one for
+// optimal tiling images, so neighbours never need bufferImageGranularity padding. Free space
+// in a block is a list of ranges ordered by offset, allocated first fit and merged on free.
+// Host visible blocks stay mapped for their whole life.
+
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+// A range of a memory block, to be bound with its offset
+struct MemoryAllocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    void* mapped = nullptr;     // Host address of the range, for host visible memory
+    int pool = -1;
+    int block = -1;
+};
+
+class MemoryAllocator {
+    struct Block {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize size = 0;
+        void* mapped = nullptr;
+        bool dedicated = false;     // Sized for one large resource, released when it is freed
+        std::map<VkDeviceSize, VkDeviceSize> freeRanges;   // Offset to size
+        int allocations = 0;
+    };
+    struct Pool {
+        uint32_t memoryType = 0;
+        std::vector<Block> blocks;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties memoryProperties{};
+    VkDeviceSize blockSize = 0;
+    std::vector<Pool> pools;    // Two per memory type: linear, then optimal tiling
+    std::mutex mutex;
+
+    static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    bool allocateFrom(Block& block, const VkMemoryRequirements& requirements, VkDeviceSize& offset);
+    int createBlock(Pool& pool, VkDeviceSize size, bool dedicated);
+
+public:
+    void init(VkPhysicalDevice physicalDevice, VkDevice device, VkDeviceSize blockSize = 64 * 1024 * 1024);
+    MemoryAllocation allocate(const VkMemoryRequirements& requirements, uint32_t memoryType, bool linear);
+    void free(MemoryAllocation& allocation);
+    void destroy();
+
+    int blockCount() const;
+    int allocationCount() const;
+};
+
+
+inline void MemoryAllocator::init(VkPhysicalDevice physicalDevice, VkDevice dev, VkDeviceSize size) {
+    device = dev;
+    blockSize = size;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+    pools.assign(2 * memoryProperties.memoryTypeCount, Pool());
+    for (uint32_t i = 0; i < pools.size(); i++) {
+        pools[i].memoryType = i / 2;
+    }
+}
+
+inline bool MemoryAllocator::allocateFrom(Block& block, const VkMemoryRequirements& requirements,
+    VkDeviceSize& offset) {
+    for (auto range = block.freeRanges.begin(); range != block.freeRanges.end(); ++range) {
+        VkDeviceSize start = alignUp(range->first, requirements.alignment);
+        VkDeviceSize end = range->first + range->second;
+        if (start + requirements.size > end) {
+            continue;
+        }
+
+        // The alignment padding before and the rest after stay free
+        VkDeviceSize rangeStart = range->first;
+        block.freeRanges.erase(range);
+        if (start > rangeStart) {
+            block.freeRanges[rangeStart] = start - rangeStart;
+        }
+        if (start + requirements.size < end) {
+            block.freeRanges[start + requirements.size] = end - start - requirements.size;
+        }
+        offset = start;
+        return true;
+    }
+    return false;
+}
+
+inline int MemoryAllocator::createBlock(Pool& pool, VkDeviceSize size, bool dedicated) {
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = pool.memoryType;
+
+    Block block;
+    if (vkAllocateMemory(device, &allocInfo, nullptr, &block.memory) != VK_SUCCESS) {
+        return -1;
+    }
+    block.size = size;
+    block.dedicated = dedicated;
+    block.freeRanges[0] = size;
+    if (memoryProperties.memoryTypes[pool.memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        vkMapMemory(device, block.memory, 0, size, 0, &block.mapped);
+    }
+
+    // Reuse the slot of a released dedicated block, so block indices stay valid
+    for (size_t i = 0; i < pool.blocks.size(); i++) {
+        if (pool.blocks[i].memory == VK_NULL_HANDLE) {
+            pool.blocks[i] = block;
+            return (int)i;
+        }
+    }
+    pool.blocks.push_back(block);
+    return (int)pool.blocks.size() - 1;
+}
+
+inline MemoryAllocation MemoryAllocator::allocate(const VkMemoryRequirements& requirements,
+    uint32_t memoryType, bool linear) {
+    std::lock_guard<std::mutex> lock(mutex);
+    int poolIndex = 2 * memoryType + (linear ? 0 : 1);
+    Pool& pool = pools[poolIndex];
+
+    // Resources larger than half a block get a block of their own
+    int blockIndex = -1;
+    VkDeviceSize offset = 0;
+    if (requirements.size <= blockSize / 2) {
+        for (size_t i = 0; i < pool.blocks.size() && blockIndex < 0; i++) {
+            Block& block = pool.blocks[i];
+            if (block.memory != VK_NULL_HANDLE && !block.dedicated &&
+                allocateFrom(block, requirements, offset)) {
+                blockIndex = (int)i;
+            }
+        }
+        if (blockIndex < 0) {
+            blockIndex = createBlock(pool, blockSize, false);
+            if (blockIndex >= 0) {
+                allocateFrom(pool.blocks[blockIndex], requirements, offset);
+            }
+        }
+    }
+    // A small heap may not fit a whole block, so fall back to the exact size
+    if (blockIndex < 0) {
+        blockIndex = createBlock(pool, requirements.size, true);
+        if (blockIndex < 0) {
+            throw std::runtime_error("failed to allocate device memory!");
+        }
+        allocateFrom(pool.blocks[blockIndex], requirements, offset);
+    }
+
+    Block& block = pool.blocks[blockIndex];
+    block.allocations++;
+
+    MemoryAllocation allocation;
+    allocation.memory = block.memory;
+    allocation.offset = offset;
+    allocation.size = requirements.size;
+    allocation.mapped = block.mapped ? static_cast<uint8_t*>(block.mapped) + offset : nullptr;
+    allocation.pool = poolIndex;
+    allocation.block = blockIndex;
+    return allocation;
+}
+
+inline void MemoryAllocator::free(MemoryAllocation& allocation) {
+    if (allocation.memory == VK_NULL_HANDLE) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    Block& block = pools[allocation.pool].blocks[allocation.block];
+    block.allocations--;
+
+    if (block.dedicated) {
+        vkFreeMemory(device, block.memory, nullptr);
+        block = Block();
+    }
+    else {
+        // Merge with the free ranges just before and just after
+        VkDeviceSize offset = allocation.offset, size = allocation.size;
+        auto next = block.freeRanges.lower_bound(offset);
+        if (next != block.freeRanges.begin()) {
+            auto prev = std::prev(next);
+            if (prev->first + prev->second == offset) {
+                offset = prev->first;
+                size += prev->second;
+                block.freeRanges.erase(prev);
+            }
+        }
+        if (next != block.freeRanges.end() && offset + size == next->first) {
+            size += next->second;
+            block.freeRanges.erase(next);
+        }
+        block.freeRanges[offset] = size;
+    }
+    allocation = MemoryAllocation();
+}
+
+inline void MemoryAllocator::destroy() {
+    for (Pool& pool : pools) {
+        for (Block& block : pool.blocks) {
+            if (block.memory != VK_NULL_HANDLE) {
+                vkFreeMemory(device, block.memory, nullptr);
+            }
+        }
+        pool.blocks.clear();
+    }
+}
+
+inline int MemoryAllocator::blockCount() const {
+    int count = 0;
+    for (const Pool& pool : pools) {
+        for (const Block& block : pool.blocks) {
+            count += block.memory != VK_NULL_HANDLE ? 1 : 0;
+        }
+    }
+    return count;
+}
+
+inline int MemoryAllocator::allocationCount() const {
+    int count = 0;
+    for (const Pool& pool : pools) {
+        for (const Block& block : pool.blocks) {
+            count += block.allocations;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,292 @@
+// MeshOptimizer.hpp
+// Index buffer optimizations run once when a mesh is loaded. Identical vertices are welded
+// through a hash table, triangles are reordered for the post-transform vertex cache with
+// Forsyth's linear-speed algorithm, then clusters of those triangles are reordered so the
+// outward facing ones are drawn first and hide the rest (Sander et al., "Fast triangle
+// reordering for vertex locality and reduced overdraw"), and vertices are renumbered in
+// the order they are first used.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Average number of vertices transformed per triangle with a FIFO cache of the given size:
+// 3 for a de-indexed mesh, about 0.5 to 0.7 for a well ordered regular one
+inline float averageCacheMissRatio(const std::vector<uint32_t>& indices, size_t vertexCount,
+    size_t cacheSize = 16) {
+    if (indices.size() < 3) {
+        return 0.0f;
+    }
+    std::vector<size_t> insertedAt(vertexCount, 0);   // FIFO time of insertion, 0 when never
+    size_t time = 0, misses = 0;
+    for (uint32_t v : indices) {
+        if (insertedAt[v] == 0 || time - insertedAt[v] >= cacheSize) {
+            insertedAt[v] = ++time;
+            misses++;
+        }
+    }
+    return (float)misses / (float)(indices.size() / 3);
+}
+
+// Merges vertices whose bytes are identical and rewrites the indices to the survivors.
+// Vert must have no padding, or padding zeroed as by Vert{}.
+template <class Vert>
+void weldVertices(std::vector<Vert>& vertices, std::vector<uint32_t>& indices) {
+    size_t tableSize = 1;
+    while (tableSize < vertices.size() * 2) {
+        tableSize *= 2;
+    }
+    const uint32_t EMPTY = ~0u;
+    std::vector<uint32_t> table(tableSize, EMPTY);     // Open addressing, indices into unique
+    std::vector<uint32_t> remap(vertices.size());
+    std::vector<Vert> unique;
+    unique.reserve(vertices.size());
+
+    for (size_t i = 0; i < vertices.size(); i++) {
+        // FNV-1a over the bytes of the vertex
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&vertices[i]);
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t b = 0; b < sizeof(Vert); b++) {
+            hash = (hash ^ bytes[b]) * 1099511628211ull;
+        }
+
+        size_t slot = (size_t)hash & (tableSize - 1);
+        while (table[slot] != EMPTY && memcmp(&unique[table[slot]], &vertices[i], sizeof(Vert)) != 0) {
+            slot = (slot + 1) & (tableSize - 1);
+        }
+        if (table[slot] == EMPTY) {
+            table[slot] = (uint32_t)unique.size();
+            unique.push_back(vertices[i]);
+        }
+        remap[i] = table[slot];
+    }
+
+    for (uint32_t& index : indices) {
+        index = remap[index];
+    }
+    vertices.swap(unique);
+}
+
+// Forsyth's greedy ordering: each step emits the triangle whose vertices score highest,
+// favouring vertices still in a simulated LRU cache and vertices with few triangles left
+inline void optimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount) {
+    const int CACHE_SIZE = 32;
+    const float CACHE_DECAY_POWER = 1.5f;
+    const float LAST_TRIANGLE_SCORE = 0.75f;
+    const float VALENCE_BOOST_SCALE = 2.0f;
+    const float VALENCE_BOOST_POWER = 0.5f;
+
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0) {
+        return;
+    }
+
+    // Triangles of each vertex, as slices of one array; remaining shrinks as they are emitted
+    std::vector<uint32_t> offsets(vertexCount + 1, 0), remaining(vertexCount, 0);
+    for (uint32_t v : indices) {
+        remaining[v]++;
+    }
+    for (size_t v = 0; v < vertexCount; v++) {
+        offsets[v + 1] = offsets[v] + remaining[v];
+    }
+    std::vector<uint32_t> adjacency(indices.size());
+    std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t t = 0; t < triangleCount; t++) {
+        for (int k = 0; k < 3; k++) {
+            adjacency[fill[indices[3 * t + k]]++] = (uint32_t)t;
+        }
+    }
+
+    std::vector<int> cachePosition(vertexCount, -1);
+    auto vertexScore = [&](uint32_t v) {
+        if (remaining[v] == 0) {
+            return -1.0f;
+        }
+        float score = 0.0f;
+        int position = cachePosition[v];
+        if (position >= 0) {
+            score = position < 3 ? LAST_TRIANGLE_SCORE :
+                std::pow(1.0f - (float)(position - 3) / (CACHE_SIZE - 3), CACHE_DECAY_POWER);
+        }
+        return score + VALENCE_BOOST_SCALE * std::pow((float)remaining[v], -VALENCE_BOOST_POWER);
+    };
+
+    std::vector<float> score(vertexCount);
+    for (size_t v = 0; v < vertexCount; v++) {
+        score[v] = vertexScore((uint32_t)v);
+    }
+    std::vector<float> triangleScore(triangleCount);
+    for (size_t t = 0; t < triangleCount; t++) {
+        triangleScore[t] = score[indices[3 * t]] + score[indices[3 * t + 1]] + score[indices[3 * t + 2]];
+    }
+
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<uint32_t> cache, nextCache;
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+    size_t cursor = 0;
+    int best = 0;
+
+    while (best >= 0) {
+        emitted[best] = true;
+        const uint32_t* tri = &indices[3 * best];
+        for (int k = 0; k < 3; k++) {
+            uint32_t v = tri[k];
+            result.push_back(v);
+            uint32_t* begin = &adjacency[offsets[v]];
+            uint32_t* end = begin + remaining[v];
+            *std::find(begin, end, (uint32_t)best) = *(end - 1);
+            remaining[v]--;
+        }
+
+        // The triangle moves to the front of the cache, the oldest vertices fall out
+        nextCache.assign(tri, tri + 3);
+        for (uint32_t v : cache) {
+            if (v != tri[0] && v != tri[1] && v != tri[2]) {
+                nextCache.push_back(v);
+            }
+        }
+        for (size_t i = 0; i < nextCache.size(); i++) {
+            cachePosition[nextCache[i]] = i < CACHE_SIZE ? (int)i : -1;
+        }
+
+        // Only the triangles of the touched vertices change score; the best of them is next
+        best = -1;
+        float bestScore = -1.0f;
+        for (uint32_t v : nextCache) {
+            score[v] = vertexScore(v);
+        }
+        for (uint32_t v : nextCache) {
+            for (uint32_t i = offsets[v]; i < offsets[v] + remaining[v]; i++) {
+                uint32_t t = adjacency[i];
+                triangleScore[t] = score[indices[3 * t]] + score[indices[3 * t + 1]] + score[indices[3 * t + 2]];
+                if (triangleScore[t] > bestScore) {
+                    bestScore = triangleScore[t];
+                    best = (int)t;
+                }
+            }
+        }
+        if (nextCache.size() > CACHE_SIZE) {
+            nextCache.resize(CACHE_SIZE);
+        }
+        cache.swap(nextCache);
+
+        // Nothing connected is left in the cache: continue with the next triangle not emitted
+        if (best < 0) {
+            while (cursor < triangleCount && emitted[cursor]) {
+                cursor++;
+            }
+            best = cursor < triangleCount ? (int)cursor : -1;
+        }
+    }
+    indices.swap(result);
+}
+
+// Splits the cache ordered triangles where the simulated cache misses a whole triangle and
+// draws the clusters facing away from the mesh centre first. The new order is kept only if
+// the cache miss ratio stays within threshold of the one it started from.
+inline void optimizeOverdraw(std::vector<uint32_t>& indices, const float* positions, size_t stride,
+    size_t vertexCount, float threshold = 1.05f) {
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount < 2) {
+        return;
+    }
+    auto position = [&](uint32_t v) {
+        return reinterpret_cast<const float*>(reinterpret_cast<const char*>(positions) + v * stride);
+    };
+
+    std::vector<size_t> clusterStart;
+    std::vector<size_t> insertedAt(vertexCount, 0);
+    size_t time = 0;
+    for (size_t t = 0; t < triangleCount; t++) {
+        int misses = 0;
+        for (int k = 0; k < 3; k++) {
+            uint32_t v = indices[3 * t + k];
+            if (insertedAt[v] == 0 || time - insertedAt[v] >= 16) {
+                insertedAt[v] = ++time;
+                misses++;
+            }
+        }
+        if (t == 0 || misses == 3) {
+            clusterStart.push_back(t);
+        }
+    }
+    clusterStart.push_back(triangleCount);
+    if (clusterStart.size() <= 2) {
+        return;
+    }
+
+    // Area weighted centroid and normal of each cluster
+    size_t clusterCount = clusterStart.size() - 1;
+    std::vector<float> centroids(3 * clusterCount, 0.0f), normals(3 * clusterCount, 0.0f), areas(clusterCount, 0.0f);
+    float meshCentroid[3] = { 0.0f, 0.0f, 0.0f };
+    float meshArea = 0.0f;
+    for (size_t c = 0; c < clusterCount; c++) {
+        for (size_t t = clusterStart[c]; t < clusterStart[c + 1]; t++) {
+            const float* a = position(indices[3 * t]);
+            const float* b = position(indices[3 * t + 1]);
+            const float* d = position(indices[3 * t + 2]);
+            float e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+            float e2[3] = { d[0] - a[0], d[1] - a[1], d[2] - a[2] };
+            float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+            float area = 0.5f * std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            for (int k = 0; k < 3; k++) {
+                float center = (a[k] + b[k] + d[k]) / 3.0f;
+                centroids[3 * c + k] += center * area;
+                normals[3 * c + k] += n[k];
+                meshCentroid[k] += center * area;
+            }
+            areas[c] += area;
+            meshArea += area;
+        }
+    }
+    if (meshArea == 0.0f) {
+        return;
+    }
+
+    std::vector<float> sortKey(clusterCount);
+    for (size_t c = 0; c < clusterCount; c++) {
+        float key = 0.0f;
+        for (int k = 0; k < 3; k++) {
+            float centroid = areas[c] > 0.0f ? centroids[3 * c + k] / areas[c] : 0.0f;
+            key += (centroid - meshCentroid[k] / meshArea) * normals[3 * c + k];
+        }
+        sortKey[c] = key;
+    }
+    std::vector<uint32_t> order(clusterCount);
+    for (size_t c = 0; c < clusterCount; c++) {
+        order[c] = (uint32_t)c;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return sortKey[a] > sortKey[b]; });
+
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+    for (uint32_t c : order) {
+        result.insert(result.end(), indices.begin() + 3 * clusterStart[c], indices.begin() + 3 * clusterStart[c + 1]);
+    }
+    if (averageCacheMissRatio(result, vertexCount) <= threshold * averageCacheMissRatio(indices, vertexCount)) {
+        indices.swap(result);
+    }
+}
+
+// Renumbers vertices in the order the indices first reach them, so vertex fetches move
+// through memory in sequence; unused vertices are dropped
+template <class Vert>
+void optimizeVertexFetch(std::vector<Vert>& vertices, std::vector<uint32_t>& indices) {
+    const uint32_t UNUSED = ~0u;
+    std::vector<uint32_t> remap(vertices.size(), UNUSED);
+    std::vector<Vert> ordered;
+    ordered.reserve(vertices.size());
+    for (uint32_t& index : indices) {
+        if (remap[index] == UNUSED) {
+            remap[index] = (uint32_t)ordered.size();
+            ordered.push_back(vertices[index]);
+        }
+        index = remap[index];
+    }
+    vertices.swap(ordered);
+}
@@ -0,0 +1,390 @@
+// NBody.hpp
+// Gravitational N-body integration with Barnes-Hut force evaluation.
+// Every step the massive bodies are sorted into an octree whose nodes store their
+// total mass and centre of mass; a distant node is then treated as a single point
+// mass, which makes the force pass O(N log N). The force pass is split across the
+// thread pool, the tree build is sequential. Bodies with zero mass (spacecraft)
+// feel gravity but are left out of the tree.
+//
+// Integration is symplectic, in double precision, with a fixed step of 1 / tickRate
+// simulation time units: leapfrog (kick-drift-kick, one force pass per tick) or
+// Yoshida's fourth order composition (three force passes per tick). The state runs
+// at most one tick ahead of the requested time and position() interpolates between
+// the last two ticks, so the cost per simulated time is independent of the frame rate.
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <stdexcept>
+#include <glm/glm.hpp>
+#include "ThreadPool.hpp"
+
+struct NBodySystem {
+    // Ratio node size / distance below which a node is used as a point mass
+    static constexpr double THETA = 0.7;
+    // Nodes holding this few bodies or fewer are not split further
+    static const int LEAF_SIZE = 8;
+    static const int MAX_DEPTH = 24;
+    // Bodies handled per thread pool chunk
+    static const int FORCE_GRAIN = 256;
+
+    struct Node {
+        double comX, comY, comZ, mass;
+        double size;            // Edge length of the node cube
+        int firstChild;         // Index of 8 consecutive children, -1 for leaves
+        int begin, end;         // Range in treeBodies covered by the node
+    };
+
+    enum Integrator { LEAPFROG, YOSHIDA4 };
+
+    // Gravitational constant and softening length
+    double G = 1.0;
+    double softening = 1e-3;
+    // Integration ticks per simulation time unit and the scheme used for each tick
+    double tickRate = 1000.0;
+    Integrator integrator = LEAPFROG;
+    // Ticks taken in one advanceTo at most, time beyond that is dropped
+    int maxTicksPerAdvance = 256;
+
+    ThreadPool* pool = nullptr;
+
+    int count = 0;
+    double time = 0.0;
+
+    std::vector<double> x, y, z;
+    std::vector<double> vx, vy, vz;
+    std::vector<double> ax, ay, az;
+    std::vector<double> mass;
+
+    // Positions at the previous tick and the blend towards the current ones for rendering
+    std::vector<double> prevX, prevY, prevZ;
+    double alpha = 1.0;
+    bool forcesCurrent = false;
+
+    std::vector<Node> nodes;
+    std::vector<int> treeBodies;
+
+    void clear();
+    int addBody(glm::vec3 position, glm::vec3 velocity, double bodyMass);
+    int addOrbitingBody(int central, glm::vec3 position, glm::vec3 orbitNormal, double bodyMass);
+    void removeNetMomentum();
+    void setTime(double t);
+    void advanceTo(double t);
+    void step(double dt);
+    void drift(double dt);
+    void kick(double dt);
+    void computeForces();
+    glm::vec3 position(int i) const;
+
+    void buildTree();
+    void buildNode(int n, double cx, double cy, double cz, double half, int depth);
+    void accelerationOf(int i, double& rax, double& ray, double& raz) const;
+};
+
+
+inline void NBodySystem::clear() {
+    count = 0;
+    time = 0.0;
+    for (std::vector<double>* a : { &x, &y, &z, &vx, &vy, &vz, &ax, &ay, &az, &mass, &prevX, &prevY, &prevZ }) {
+        a->clear();
+    }
+    alpha = 1.0;
+    forcesCurrent = false;
+    nodes.clear();
+    treeBodies.clear();
+}
+
+inline int NBodySystem::addBody(glm::vec3 position, glm::vec3 velocity, double bodyMass) {
+    if (bodyMass < 0.0) {
+        throw std::runtime_error("N-body masses must not be negative");
+    }
+    x.push_back(position.x);
+    y.push_back(position.y);
+    z.push_back(position.z);
+    vx.push_back(velocity.x);
+    vy.push_back(velocity.y);
+    vz.push_back(velocity.z);
+    ax.push_back(0.0);
+    ay.push_back(0.0);
+    az.push_back(0.0);
+    mass.push_back(bodyMass);
+    prevX.push_back(position.x);
+    prevY.push_back(position.y);
+    prevZ.push_back(position.z);
+    forcesCurrent = false;
+    return count++;
+}
+
+// Adds a body on a circular orbit around 'central', in the plane with the given normal
+inline int NBodySystem::addOrbitingBody(int central, glm::vec3 position, glm::vec3 orbitNormal, double bodyMass) {
+    glm::vec3 c(x[central], y[central], z[central]);
+    glm::vec3 cv(vx[central], vy[central], vz[central]);
+    glm::vec3 r = position - c;
+    double distance = glm::length(r);
+    if (distance <= 0.0) {
+        throw std::runtime_error("N-body orbit around a body at the same position");
+    }
+    float speed = (float)std::sqrt(G * (mass[central] + bodyMass) / distance);
+    glm::vec3 direction = glm::normalize(glm::cross(orbitNormal, r));
+    return addBody(position, cv + direction * speed, bodyMass);
+}
+
+// Shifts all velocities so the system as a whole does not drift away
+inline void NBodySystem::removeNetMomentum() {
+    double px = 0.0, py = 0.0, pz = 0.0, total = 0.0;
+    for (int i = 0; i < count; i++) {
+        px += mass[i] * vx[i];
+        py += mass[i] * vy[i];
+        pz += mass[i] * vz[i];
+        total += mass[i];
+    }
+    if (total <= 0.0) {
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        vx[i] -= px / total;
+        vy[i] -= py / total;
+        vz[i] -= pz / total;
+    }
+}
+
+inline void NBodySystem::setTime(double t) {
+    time = t;
+    prevX = x;
+    prevY = y;
+    prevZ = z;
+    alpha = 1.0;
+    computeForces();
+}
+
+// Ticks until the state is at or just past t, then sets the interpolation factor for t
+inline void NBodySystem::advanceTo(double t) {
+    double dt = 1.0 / tickRate;
+    int ticks = 0;
+    while (time < t && ticks < maxTicksPerAdvance) {
+        prevX = x;
+        prevY = y;
+        prevZ = z;
+        step(dt);
+        time += dt;
+        ticks++;
+    }
+
+    // Falling behind: let the simulation run slower than real time instead of piling up work
+    if (time < t) {
+        time = t;
+    }
+    alpha = std::min(std::max(1.0 - (time - t) * tickRate, 0.0), 1.0);
+}
+
+inline void NBodySystem::drift(double dt) {
+    for (int i = 0; i < count; i++) {
+        x[i] += vx[i] * dt;
+        y[i] += vy[i] * dt;
+        z[i] += vz[i] * dt;
+    }
+    forcesCurrent = false;
+}
+
+inline void NBodySystem::kick(double dt) {
+    for (int i = 0; i < count; i++) {
+        vx[i] += ax[i] * dt;
+        vy[i] += ay[i] * dt;
+        vz[i] += az[i] * dt;
+    }
+}
+
+inline void NBodySystem::step(double dt) {
+    if (integrator == LEAPFROG) {
+        if (!forcesCurrent) {
+            computeForces();
+        }
+        kick(0.5 * dt);
+        drift(dt);
+        computeForces();
+        kick(0.5 * dt);
+        return;
+    }
+
+    // Yoshida: drift-kick stages with weights w1, w0, w1, where w1 = 1 / (2 - 2^(1/3))
+    // and w0 = 1 - 2 w1 make the composition of three leapfrogs fourth order
+    const double w1 = 1.3512071919596578, w0 = -1.7024143839193153;
+    const double d[3] = { w1, w0, w1 };
+    const double c[4] = { 0.5 * w1, 0.5 * (w0 + w1), 0.5 * (w0 + w1), 0.5 * w1 };
+    for (int k = 0; k < 3; k++) {
+        drift(c[k] * dt);
+        computeForces();
+        kick(d[k] * dt);
+    }
+    drift(c[3] * dt);
+}
+
+inline void NBodySystem::computeForces() {
+    buildTree();
+
+    auto evaluate = [this](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            accelerationOf(i, ax[i], ay[i], az[i]);
+        }
+    };
+    if (pool) {
+        pool->parallelFor(count, FORCE_GRAIN, evaluate);
+    }
+    else {
+        evaluate(0, count);
+    }
+    forcesCurrent = true;
+}
+
+inline void NBodySystem::buildTree() {
+    nodes.clear();
+    treeBodies.clear();
+    double minX = INFINITY, minY = INFINITY, minZ = INFINITY;
+    double maxX = -INFINITY, maxY = -INFINITY, maxZ = -INFINITY;
+    for (int i = 0; i < count; i++) {
+        if (mass[i] > 0.0) {
+            treeBodies.push_back(i);
+            minX = std::min(minX, x[i]); maxX = std::max(maxX, x[i]);
+            minY = std::min(minY, y[i]); maxY = std::max(maxY, y[i]);
+            minZ = std::min(minZ, z[i]); maxZ = std::max(maxZ, z[i]);
+        }
+    }
+    if (treeBodies.empty()) {
+        return;
+    }
+
+    double half = 0.5 * std::max({ maxX - minX, maxY - minY, maxZ - minZ }) * 1.0001 + 1e-9;
+    nodes.push_back({ 0.0, 0.0, 0.0, 0.0, 2.0 * half, -1, 0, (int)treeBodies.size() });
+    buildNode(0, 0.5 * (minX + maxX), 0.5 * (minY + maxY), 0.5 * (minZ + maxZ), half, 0);
+}
+
+// Partitions the bodies of node n into its octants, recursing until the leaves are small
+inline void NBodySystem::buildNode(int n, double cx, double cy, double cz, double half, int depth) {
+    int begin = nodes[n].begin, end = nodes[n].end;
+
+    if (end - begin <= LEAF_SIZE || depth >= MAX_DEPTH) {
+        double m = 0.0, mx = 0.0, my = 0.0, mz = 0.0;
+        for (int k = begin; k < end; k++) {
+            int i = treeBodies[k];
+            m += mass[i];
+            mx += mass[i] * x[i];
+            my += mass[i] * y[i];
+            mz += mass[i] * z[i];
+        }
+        Node& node = nodes[n];
+        node.mass = m;
+        node.comX = mx / m;
+        node.comY = my / m;
+        node.comZ = mz / m;
+        return;
+    }
+
+    // Counting sort of the range by octant
+    int octantCount[8] = {};
+    auto octantOf = [&](int i) {
+        return (x[i] >= cx ? 1 : 0) | (y[i] >= cy ? 2 : 0) | (z[i] >= cz ? 4 : 0);
+    };
+    for (int k = begin; k < end; k++) {
+        octantCount[octantOf(treeBodies[k])]++;
+    }
+    int octantStart[8];
+    int offset = begin;
+    for (int o = 0; o < 8; o++) {
+        octantStart[o] = offset;
+        offset += octantCount[o];
+    }
+    std::vector<int> sorted(end - begin);
+    int fill[8];
+    std::copy(octantStart, octantStart + 8, fill);
+    for (int k = begin; k < end; k++) {
+        int i = treeBodies[k];
+        sorted[fill[octantOf(i)]++ - begin] = i;
+    }
+    std::copy(sorted.begin(), sorted.end(), treeBodies.begin() + begin);
+
+    int first = (int)nodes.size();
+    nodes[n].firstChild = first;
+    for (int o = 0; o < 8; o++) {
+        nodes.push_back({ 0.0, 0.0, 0.0, 0.0, half, -1, octantStart[o], octantStart[o] + octantCount[o] });
+    }
+
+    double m = 0.0, mx = 0.0, my = 0.0, mz = 0.0;
+    double q = 0.5 * half;
+    for (int o = 0; o < 8; o++) {
+        if (octantCount[o] == 0) {
+            continue;
+        }
+        buildNode(first + o, cx + ((o & 1) ? q : -q), cy + ((o & 2) ? q : -q), cz + ((o & 4) ? q : -q), q, depth + 1);
+        const Node& child = nodes[first + o];
+        m += child.mass;
+        mx += child.mass * child.comX;
+        my += child.mass * child.comY;
+        mz += child.mass * child.comZ;
+    }
+    Node& node = nodes[n];
+    node.mass = m;
+    node.comX = mx / m;
+    node.comY = my / m;
+    node.comZ = mz / m;
+}
+
+inline void NBodySystem::accelerationOf(int i, double& rax, double& ray, double& raz) const {
+    double px = x[i], py = y[i], pz = z[i];
+    double eps2 = softening * softening;
+    double theta2 = THETA * THETA;
+    double sx = 0.0, sy = 0.0, sz = 0.0;
+
+    auto pull = [&](double m, double qx, double qy, double qz) {
+        double dx = qx - px, dy = qy - py, dz = qz - pz;
+        double d2 = dx * dx + dy * dy + dz * dz + eps2;
+        double f = m / (d2 * std::sqrt(d2));
+        sx += f * dx;
+        sy += f * dy;
+        sz += f * dz;
+    };
+
+    int stack[8 * MAX_DEPTH + 8];
+    int top = 0;
+    if (!nodes.empty()) {
+        stack[top++] = 0;
+    }
+    while (top > 0) {
+        const Node& node = nodes[stack[--top]];
+        if (node.mass <= 0.0) {
+            continue;
+        }
+
+        if (node.firstChild < 0) {
+            for (int k = node.begin; k < node.end; k++) {
+                int j = treeBodies[k];
+                if (j != i) {
+                    pull(mass[j], x[j], y[j], z[j]);
+                }
+            }
+            continue;
+        }
+
+        double dx = node.comX - px, dy = node.comY - py, dz = node.comZ - pz;
+        double d2 = dx * dx + dy * dy + dz * dz;
+        if (node.size * node.size < theta2 * d2) {
+            pull(node.mass, node.comX, node.comY, node.comZ);
+        }
+        else {
+            for (int o = 0; o < 8; o++) {
+                stack[top++] = node.firstChild + o;
+            }
+        }
+    }
+
+    rax = G * sx;
+    ray = G * sy;
+    raz = G * sz;
+}
+
+// Position at the time of the last advanceTo, between the previous and the current tick
+inline glm::vec3 NBodySystem::position(int i) const {
+    return glm::vec3((float)(prevX[i] + (x[i] - prevX[i]) * alpha),
+        (float)(prevY[i] + (y[i] - prevY[i]) * alpha),
+        (float)(prevZ[i] + (z[i] - prevZ[i]) * alpha));
+}
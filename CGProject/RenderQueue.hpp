@@ -0,0 +1,125 @@
+// RenderQueue.hpp
+// Draws of one render pass, each submitted with a packed 64-bit sort key and ordered with
+// an LSD radix sort. Opaque draws are grouped by pipeline and material and run front to
+// back within a group, so a command buffer binds each state once and early depth testing
+// rejects what is hidden; transparent draws run back to front after them.
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+
+// Key layout, most significant bits first:
+//   opaque and background: pass (2) | pipeline (8) | material (16) | depth (24) | unused (14)
+//   transparent:           pass (2) | inverted depth (24) | pipeline (8) | material (16) | unused (14)
+enum RenderPass { OPAQUE_PASS = 0, BACKGROUND_PASS = 1, TRANSPARENT_PASS = 2 };
+
+template <class Item>
+class RenderQueue {
+    static const uint64_t DEPTH_MAX = (1u << 24) - 1;
+
+    std::vector<Item> items;
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> order, scratch;
+    std::vector<Item> sorted;
+
+    // Pipelines and materials get small ids in the order they are first seen, kept across
+    // frames so that equal scenes sort the same way
+    std::vector<const void*> pipelines, materials;
+
+    static uint32_t intern(std::vector<const void*>& table, const void* p, size_t limit);
+
+public:
+    void clear();
+
+    // depth is the distance to the camera over the far plane, clamped to [0, 1]
+    void push(const Item& item, RenderPass pass, const void* pipeline, const void* material, float depth);
+    void sort();
+
+    size_t size() const { return sorted.size(); }
+    const Item& operator[](size_t i) const { return sorted[i]; }
+
+    // Indices, in push order, of the sorted items: equal between two sorts of the same pushes
+    // exactly when they draw in the same order
+    const std::vector<uint32_t>& drawOrder() const { return order; }
+
+    static uint64_t makeKey(RenderPass pass, uint32_t pipeline, uint32_t material, float depth);
+};
+
+
+template <class Item>
+uint32_t RenderQueue<Item>::intern(std::vector<const void*>& table, const void* p, size_t limit) {
+    for (size_t i = 0; i < table.size(); i++) {
+        if (table[i] == p) {
+            return (uint32_t)i;
+        }
+    }
+    if (table.size() == limit) {
+        throw std::runtime_error("Too many distinct states in the render queue");
+    }
+    table.push_back(p);
+    return (uint32_t)(table.size() - 1);
+}
+
+template <class Item>
+void RenderQueue<Item>::clear() {
+    items.clear();
+    keys.clear();
+}
+
+template <class Item>
+void RenderQueue<Item>::push(const Item& item, RenderPass pass, const void* pipeline,
+    const void* material, float depth) {
+    items.push_back(item);
+    keys.push_back(makeKey(pass, intern(pipelines, pipeline, 1 << 8),
+        intern(materials, material, 1 << 16), depth));
+}
+
+template <class Item>
+uint64_t RenderQueue<Item>::makeKey(RenderPass pass, uint32_t pipeline, uint32_t material, float depth) {
+    depth = depth < 0.0f ? 0.0f : (depth > 1.0f ? 1.0f : depth);
+    uint64_t d = (uint64_t)(depth * DEPTH_MAX);
+    uint64_t key = (uint64_t)pass << 62;
+    if (pass == TRANSPARENT_PASS) {
+        return key | (DEPTH_MAX - d) << 38 | (uint64_t)pipeline << 30 | (uint64_t)material << 14;
+    }
+    return key | (uint64_t)pipeline << 54 | (uint64_t)material << 38 | d << 14;
+}
+
+template <class Item>
+void RenderQueue<Item>::sort() {
+    size_t n = keys.size();
+    order.resize(n);
+    scratch.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        order[i] = (uint32_t)i;
+    }
+
+    // One stable counting pass per byte, lowest first
+    for (int shift = 0; shift < 64 && n > 1; shift += 8) {
+        size_t count[256] = {};
+        for (uint32_t i : order) {
+            count[(keys[i] >> shift) & 0xFF]++;
+        }
+        // A byte shared by every key, such as the unused low bits, leaves the order as it is
+        if (count[(keys[order[0]] >> shift) & 0xFF] == n) {
+            continue;
+        }
+        size_t offset = 0;
+        for (size_t& c : count) {
+            size_t digits = c;
+            c = offset;
+            offset += digits;
+        }
+        for (uint32_t i : order) {
+            scratch[count[(keys[i] >> shift) & 0xFF]++] = i;
+        }
+        order.swap(scratch);
+    }
+
+    sorted.clear();
+    for (uint32_t i : order) {
+        sorted.push_back(items[i]);
+    }
+}
@@ -0,0 +1,72 @@
+// SceneGraph.hpp
+// Flat transform hierarchy. Nodes are stored in creation order and a parent is always
+// created before its children, so one forward pass computes every world matrix from
+// the already final matrix of its parent. A node is recomputed only when its local
+// matrix changed since the last update or when its parent's world matrix changed;
+// setting a local matrix to the value it already has changes nothing.
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <glm/glm.hpp>
+
+struct SceneGraph {
+    std::vector<int> parent;        // -1 for roots
+    std::vector<glm::mat4> local;
+    std::vector<glm::mat4> world;
+    std::vector<uint8_t> dirty;     // Local matrix changed since the last update
+    std::vector<uint8_t> changed;   // World matrix recomputed by the last update
+
+    // Number of world matrices recomputed by the last update
+    int updatedNodes = 0;
+
+    int addNode(int parentNode = -1, const glm::mat4& localMatrix = glm::mat4(1.0f));
+    void setLocal(int n, const glm::mat4& localMatrix);
+    void update();
+    glm::vec3 worldPosition(int n) const;
+};
+
+
+inline int SceneGraph::addNode(int parentNode, const glm::mat4& localMatrix) {
+    int n = (int)parent.size();
+    if (parentNode >= n) {
+        throw std::runtime_error("Scene graph nodes must be added after their parent");
+    }
+    parent.push_back(parentNode);
+    local.push_back(localMatrix);
+    world.push_back(localMatrix);
+    dirty.push_back(1);
+    changed.push_back(0);
+    return n;
+}
+
+inline void SceneGraph::setLocal(int n, const glm::mat4& localMatrix) {
+    if (memcmp(&local[n], &localMatrix, sizeof(glm::mat4)) == 0) {
+        return;
+    }
+    local[n] = localMatrix;
+    dirty[n] = 1;
+}
+
+inline void SceneGraph::update() {
+    updatedNodes = 0;
+    for (size_t n = 0; n < parent.size(); n++) {
+        int p = parent[n];
+        if (dirty[n] || (p >= 0 && changed[p])) {
+            world[n] = p >= 0 ? world[p] * local[n] : local[n];
+            dirty[n] = 0;
+            changed[n] = 1;
+            updatedNodes++;
+        }
+        else {
+            changed[n] = 0;
+        }
+    }
+}
+
+inline glm::vec3 SceneGraph::worldPosition(int n) const {
+    return glm::vec3(world[n][3]);
+}
@@ -0,0 +1,156 @@
+// Simd.hpp
+// Small 4-wide float SIMD wrapper used by the batched simulation kernels.
+// Maps to SSE2 on x86, NEON on ARM (Apple Silicon) and plain scalar code elsewhere.
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define SIMD_NEON
+#endif
+
+namespace simd {
+
+    // Number of floats processed by one f32x4 operation
+    const int WIDTH = 4;
+
+    // Rounds a count up to a whole number of SIMD lanes
+    inline size_t padToWidth(size_t n) {
+        return (n + WIDTH - 1) / WIDTH * WIDTH;
+    }
+
+#if defined(SIMD_SSE2)
+
+    struct f32x4 { __m128 v; };
+    struct i32x4 { __m128i v; };
+
+    inline f32x4 load(const float* p) { return { _mm_loadu_ps(p) }; }
+    inline void store(float* p, f32x4 a) { _mm_storeu_ps(p, a.v); }
+    inline f32x4 set1(float s) { return { _mm_set1_ps(s) }; }
+    inline i32x4 set1i(int32_t s) { return { _mm_set1_epi32(s) }; }
+
+    inline f32x4 operator+(f32x4 a, f32x4 b) { return { _mm_add_ps(a.v, b.v) }; }
+    inline f32x4 operator-(f32x4 a, f32x4 b) { return { _mm_sub_ps(a.v, b.v) }; }
+    inline f32x4 operator*(f32x4 a, f32x4 b) { return { _mm_mul_ps(a.v, b.v) }; }
+    inline f32x4 operator/(f32x4 a, f32x4 b) { return { _mm_div_ps(a.v, b.v) }; }
+    inline f32x4 sqrt(f32x4 a) { return { _mm_sqrt_ps(a.v) }; }
+    inline f32x4 min(f32x4 a, f32x4 b) { return { _mm_min_ps(a.v, b.v) }; }
+    inline f32x4 max(f32x4 a, f32x4 b) { return { _mm_max_ps(a.v, b.v) }; }
+
+    inline i32x4 roundToInt(f32x4 a) { return { _mm_cvtps_epi32(a.v) }; }
+    inline f32x4 toFloat(i32x4 a) { return { _mm_cvtepi32_ps(a.v) }; }
+    inline i32x4 operator&(i32x4 a, i32x4 b) { return { _mm_and_si128(a.v, b.v) }; }
+    inline i32x4 operator+(i32x4 a, i32x4 b) { return { _mm_add_epi32(a.v, b.v) }; }
+    inline i32x4 cmpeq(i32x4 a, i32x4 b) { return { _mm_cmpeq_epi32(a.v, b.v) }; }
+
+    // Flips the sign of the lanes whose bit 1 is set in q
+    inline f32x4 negateIf(f32x4 a, i32x4 q) {
+        __m128i sign = _mm_slli_epi32(_mm_and_si128(q.v, _mm_set1_epi32(2)), 30);
+        return { _mm_xor_ps(a.v, _mm_castsi128_ps(sign)) };
+    }
+
+    // Picks a where mask is all ones, b elsewhere
+    inline f32x4 select(i32x4 mask, f32x4 a, f32x4 b) {
+        __m128 m = _mm_castsi128_ps(mask.v);
+        return { _mm_or_ps(_mm_and_ps(m, a.v), _mm_andnot_ps(m, b.v)) };
+    }
+
+#elif defined(SIMD_NEON)
+
+    struct f32x4 { float32x4_t v; };
+    struct i32x4 { int32x4_t v; };
+
+    inline f32x4 load(const float* p) { return { vld1q_f32(p) }; }
+    inline void store(float* p, f32x4 a) { vst1q_f32(p, a.v); }
+    inline f32x4 set1(float s) { return { vdupq_n_f32(s) }; }
+    inline i32x4 set1i(int32_t s) { return { vdupq_n_s32(s) }; }
+
+    inline f32x4 operator+(f32x4 a, f32x4 b) { return { vaddq_f32(a.v, b.v) }; }
+    inline f32x4 operator-(f32x4 a, f32x4 b) { return { vsubq_f32(a.v, b.v) }; }
+    inline f32x4 operator*(f32x4 a, f32x4 b) { return { vmulq_f32(a.v, b.v) }; }
+    inline f32x4 operator/(f32x4 a, f32x4 b) { return { vdivq_f32(a.v, b.v) }; }
+    inline f32x4 sqrt(f32x4 a) { return { vsqrtq_f32(a.v) }; }
+    inline f32x4 min(f32x4 a, f32x4 b) { return { vminq_f32(a.v, b.v) }; }
+    inline f32x4 max(f32x4 a, f32x4 b) { return { vmaxq_f32(a.v, b.v) }; }
+
+    inline i32x4 roundToInt(f32x4 a) { return { vcvtnq_s32_f32(a.v) }; }
+    inline f32x4 toFloat(i32x4 a) { return { vcvtq_f32_s32(a.v) }; }
+    inline i32x4 operator&(i32x4 a, i32x4 b) { return { vandq_s32(a.v, b.v) }; }
+    inline i32x4 operator+(i32x4 a, i32x4 b) { return { vaddq_s32(a.v, b.v) }; }
+    inline i32x4 cmpeq(i32x4 a, i32x4 b) { return { vreinterpretq_s32_u32(vceqq_s32(a.v, b.v)) }; }
+
+    inline f32x4 negateIf(f32x4 a, i32x4 q) {
+        uint32x4_t sign = vshlq_n_u32(vreinterpretq_u32_s32(vandq_s32(q.v, vdupq_n_s32(2))), 30);
+        return { vreinterpretq_f32_u32(veorq_u32(vreinterpretq_u32_f32(a.v), sign)) };
+    }
+
+    inline f32x4 select(i32x4 mask, f32x4 a, f32x4 b) {
+        return { vbslq_f32(vreinterpretq_u32_s32(mask.v), a.v, b.v) };
+    }
+
+#else
+
+    struct f32x4 { float v[4]; };
+    struct i32x4 { int32_t v[4]; };
+
+#define SIMD_SCALAR_OP(T, expr) T r; for (int l = 0; l < 4; l++) { r.v[l] = expr; } return r;
+
+    inline f32x4 load(const float* p) { SIMD_SCALAR_OP(f32x4, p[l]) }
+    inline void store(float* p, f32x4 a) { for (int l = 0; l < 4; l++) p[l] = a.v[l]; }
+    inline f32x4 set1(float s) { SIMD_SCALAR_OP(f32x4, s) }
+    inline i32x4 set1i(int32_t s) { SIMD_SCALAR_OP(i32x4, s) }
+
+    inline f32x4 operator+(f32x4 a, f32x4 b) { SIMD_SCALAR_OP(f32x4, a.v[l] + b.v[l]) }
+    inline f32x4 operator-(f32x4 a, f32x4 b) { SIMD_SCALAR_OP(f32x4, a.v[l] - b.v[l]) }
+    inline f32x4 operator*(f32x4 a, f32x4 b) { SIMD_SCALAR_OP(f32x4, a.v[l] * b.v[l]) }
+    inline f32x4 operator/(f32x4 a, f32x4 b) { SIMD_SCALAR_OP(f32x4, a.v[l] / b.v[l]) }
+    inline f32x4 sqrt(f32x4 a) { SIMD_SCALAR_OP(f32x4, std::sqrt(a.v[l])) }
+    inline f32x4 min(f32x4 a, f32x4 b) { SIMD_SCALAR_OP(f32x4, a.v[l] < b.v[l] ? a.v[l] : b.v[l]) }
+    inline f32x4 max(f32x4 a, f32x4 b) { SIMD_SCALAR_OP(f32x4, a.v[l] > b.v[l] ? a.v[l] : b.v[l]) }
+
+    inline i32x4 roundToInt(f32x4 a) { SIMD_SCALAR_OP(i32x4, (int32_t)std::nearbyint(a.v[l])) }
+    inline f32x4 toFloat(i32x4 a) { SIMD_SCALAR_OP(f32x4, (float)a.v[l]) }
+    inline i32x4 operator&(i32x4 a, i32x4 b) { SIMD_SCALAR_OP(i32x4, a.v[l] & b.v[l]) }
+    inline i32x4 operator+(i32x4 a, i32x4 b) { SIMD_SCALAR_OP(i32x4, a.v[l] + b.v[l]) }
+    inline i32x4 cmpeq(i32x4 a, i32x4 b) { SIMD_SCALAR_OP(i32x4, a.v[l] == b.v[l] ? -1 : 0) }
+
+    inline f32x4 negateIf(f32x4 a, i32x4 q) { SIMD_SCALAR_OP(f32x4, (q.v[l] & 2) ? -a.v[l] : a.v[l]) }
+    inline f32x4 select(i32x4 mask, f32x4 a, f32x4 b) { SIMD_SCALAR_OP(f32x4, mask.v[l] ? a.v[l] : b.v[l]) }
+
+#undef SIMD_SCALAR_OP
+
+#endif
+
+    // Sine and cosine of four angles at once (Cephes-style minimax polynomials).
+    // Accurate to a few ulp for |x| up to a few thousand radians.
+    inline void sincos(f32x4 x, f32x4& s, f32x4& c) {
+        // Range reduction to [-pi/4, pi/4] with a three-part pi/2 (Cody-Waite)
+        i32x4 q = roundToInt(x * set1(0.63661977236758134f));
+        f32x4 qf = toFloat(q);
+        f32x4 r = x - qf * set1(1.5703125f);
+        r = r - qf * set1(4.837512969970703125e-4f);
+        r = r - qf * set1(7.54978995489188216e-8f);
+
+        f32x4 r2 = r * r;
+        f32x4 ps = set1(-1.9515295891e-4f);
+        ps = ps * r2 + set1(8.3321608736e-3f);
+        ps = ps * r2 + set1(-1.6666654611e-1f);
+        ps = ps * r2 * r + r;
+
+        f32x4 pc = set1(2.443315711809948e-5f);
+        pc = pc * r2 + set1(-1.388731625493765e-3f);
+        pc = pc * r2 + set1(4.166664568298827e-2f);
+        pc = pc * r2 * r2 - set1(0.5f) * r2 + set1(1.0f);
+
+        // Odd quadrants swap sine and cosine, the quadrant number gives the signs
+        i32x4 swap = cmpeq(q & set1i(1), set1i(1));
+        s = negateIf(select(swap, pc, ps), q);
+        c = negateIf(select(swap, ps, pc), q + set1i(1));
+    }
+}
@@ -4,7 +4,16 @@
 #include <json.hpp>
 #include <fstream>
 #include <math.h>
+#include <random>
+#include <thread>
 #include "Starter.hpp"
+#include "SolarSystemEphemeris.hpp"
+#include "EphemerisCache.hpp"
+#include "TrajectoryExport.hpp"
+#include "NBody.hpp"
+#include "SceneGraph.hpp"
+#include "Frustum.hpp"
+#include "RenderQueue.hpp"
 #define _USE_MATH_DEFINES
 
 using json = nlohmann::json;
@@ -22,6 +31,61 @@ struct skyBoxUniformBufferObject {
     alignas(16) glm::mat4 mvpMat;
 };
 
+// Camera and light, the same for every object of a frame. Used by the instanced sphere
+// draw, whose model matrices are per instance, and by the frame set of the split layout.
+struct FrameUniformBlock {
+    alignas(16) glm::mat4 view;
+    alignas(16) glm::mat4 proj;
+    alignas(16) glm::vec3 lightPos;
+};
+
+// Per-object uniform block of the split layout
+struct ObjectUniformBlock {
+    alignas(16) glm::mat4 model;
+    alignas(16) glm::mat4 normal;       // Inverse transpose of the model matrix
+    alignas(16) glm::uvec4 material;    // x: 1 for the emissive sun
+};
+
+// Per-instance data of the instanced sphere draw
+struct SphereInstance {
+    glm::mat4 model;
+    glm::uvec2 material;    // x: texture layer, y: 1 for the emissive sun
+};
+
+// Orbital elements of one asteroid as read by Asteroid.comp (std430)
+struct AsteroidOrbit {
+    glm::vec4 periapsis;    // xyz: semi-major axis times the periapsis direction, w: eccentricity
+    glm::vec4 minorAxis;    // xyz: semi-minor axis times the direction 90 degrees ahead, w: size
+    glm::vec4 phase;        // x: mean anomaly at time zero in turns, yz: mean motion in turns per time unit
+                            // as a high part of 12 significant bits and the rest, see splitHigh
+};
+
+// Uniform buffer shared by the asteroid compute pass and the instanced asteroid draw
+struct AsteroidUniformBlock {
+    alignas(16) glm::mat4 viewProj;
+    alignas(16) glm::vec3 lightPos;
+    float time;             // High part of the clock, 12 significant bits
+    float timeLow;          // Rest of the clock, time + timeLow is the double accumulatedTime
+};
+
+// Uniform block of one Cull.comp pass
+struct CullUniformBlock {
+    alignas(16) glm::mat4 pyramidViewProj;  // Camera of the frame the depth pyramid was built from
+    alignas(16) glm::vec4 planes[6];        // Frustum of the current camera
+    alignas(16) glm::vec4 pyramid;          // xy: size of level 0, z: levels, w: 1 if the pyramid may be used
+    alignas(16) glm::uvec4 instances;       // x: count, y: words per instance, z: word offset of the placement,
+                                            // w: 1 for a model matrix, 0 for a vec4 of center and size
+    float radiusScale;                      // Mesh radius
+};
+
+// Output of one culling pass: the visible instances, and the indirect draw that reads them
+struct CulledDraw {
+    StorageBuffer visible;
+    StorageBuffer indirect;
+    DescriptorSet DS;
+    CullUniformBlock ubo;
+};
+
 // The vertex data structure for planets and other objects
 struct Vertex {
     glm::vec3 pos;
@@ -37,10 +101,10 @@ struct SkyboxVertex {
 class SolarSimulator : public BaseProject {
 protected:
     float speedMultiplier = 0.75f;
-    const float speedStep = 0.05f;
+    const float speedStep = 0.05f;     // Relative change per frame while M or N is held
     const float minSpeed = 0.1f;
-    const float maxSpeed = 3.0f;
-    float accumulatedTime = 0.0f;
+    const float maxSpeed = 1.0e6f;
+    double accumulatedTime = 0.0; // 64-bit so orbits stay smooth during long sessions
 
     // Current aspect ratio
     float Ar;
@@ -48,10 +112,13 @@ protected:
     // Descriptor Layouts
     DescriptorSetLayout DSL;
     DescriptorSetLayout DSLskyBox;
+    DescriptorSetLayout DSLframe;
 
     // Vertex formats
     VertexDescriptor VD;
     VertexDescriptor skyboxVD;
+    // Planet and sphere vertices stored in 16 bytes instead of 32, see usePackedLayout
+    bool compactVertices = false;
 
     // Pipelines
     Pipeline P, sunP, skyboxP;
@@ -81,25 +148,96 @@ protected:
     UniformBlock saturnRingUBO;
     skyBoxUniformBufferObject skyboxUBO;
 
-    // Planet properties
-    struct PlanetProperties {
-        float orbitRadius;
-        float revolutionSpeed;
-        float rotationSpeed;
-        float eclipticInclination;
-        float axialTilt;
-        glm::vec3 scale;
-    };
-    PlanetProperties planetProps[NUM_PLANETS];
-
-    // Moon properties
-    struct MoonProperties {
-        float orbitRadius;
-        float revolutionSpeed;
-        float rotationSpeed;
-        glm::vec3 scale;
+    // Split uniform layout: the camera and the light live in one frame set, bound once per
+    // frame at set 0, and the set of each object only holds its matrices and texture. The
+    // sun is then drawn with the planet pipeline.
+    bool splitUniforms = false;
+    DescriptorSet frameDS;
+    FrameUniformBlock frameUBO;
+
+    // Visible set of the frame. When the command buffers are recorded every frame, only the
+    // objects whose bounding sphere intersects the view frustum are drawn.
+    bool sunVisible = true;
+    bool planetVisible[NUM_PLANETS];
+    bool moonVisible = true;
+    bool saturnRingVisible = true;
+    float sphereRadius, saturnRingRadius;   // Bounding radii of the meshes in model space
+    std::vector<SphereInstance> visibleSphereInstances;
+
+    // Draws of the render pass, sorted by state and depth. With parallel recording, every
+    // worker records a slice of the queue into a secondary command buffer.
+    enum DrawKind { DRAW_SKYBOX, DRAW_SPHERES, DRAW_BODY, DRAW_ASTEROIDS };
+    struct DrawItem {
+        DrawKind kind;
+        Pipeline* pipeline;
+        DescriptorSet* DS;
+        Model<Vertex>* model;   // Mesh, null for the skybox which has its own vertex format
     };
-    MoonProperties moonProps;
+    RenderQueue<DrawItem> drawQueue;
+
+    // Order of the queue each command buffer was recorded with. Recorded once, a buffer keeps
+    // the order of the camera it was recorded for, so it is recorded again when the order moves.
+    std::vector<std::vector<uint32_t>> recordedDrawOrder;
+
+    // Projection planes, the far plane also scales the depth of the sort keys
+    static constexpr float nearPlane = 0.1f;
+    static constexpr float farPlane = 500.0f;
+
+    // Orbits and rotations of the planets and the moon, evaluated as one batch
+    SolarSystemEphemeris solarSystem;
+    EphemerisBatch& ephemeris = solarSystem.batch;
+    int moonIndex;
+
+    // Keyframes of the ephemeris positions, so that time warp costs nothing extra per frame
+    EphemerisCache ephemerisCache;
+
+    // Transform hierarchy: every ephemeris body has an orbit node holding its position,
+    // which its satellites inherit, and a body node below it with tilt, spin and scale
+    SceneGraph scene;
+    int sunOrbitNode, sunNode;
+    std::vector<int> orbitNode, bodyNode;
+    int saturnRingNode;
+
+    // Mutual gravity mode: sun, planets and asteroids integrated as an N-body system
+    ThreadPool workers;
+    NBodySystem nbody;
+    bool nbodyMode = false;
+
+    // Sun, planets and moons drawn as instances of one sphere mesh in a single draw call.
+    // Instance 0 is the sun and instance i + 1 ephemeris body i, each with its own texture layer.
+    bool instancedSpheres = false;
+    VertexDescriptor sphereVD;
+    Pipeline sphereP;
+    Model<Vertex> sphere;
+    Texture sphereTextures;
+    DescriptorSet sphereDS;
+    InstanceBuffer sphereInstances;
+    FrameUniformBlock sphereUBO;
+    std::vector<SphereInstance> sphereInstanceData;
+
+    // Asteroid belts propagated on the GPU: a compute pass writes every asteroid position
+    // into a buffer that the instanced asteroid draw reads directly as per-instance data
+    bool gpuBelts = false;
+    int asteroidCount = 0;
+    DescriptorSetLayout DSLasteroidCompute, DSLasteroid;
+    VertexDescriptor asteroidVD;
+    ComputePipeline asteroidCP;
+    Pipeline asteroidP;
+    Model<Vertex> asteroid;
+    StorageBuffer asteroidOrbits, asteroidInstances;
+    DescriptorSet asteroidComputeDS, asteroidDS;
+    AsteroidUniformBlock asteroidUBO;
+
+    // GPU-driven culling: compute passes test the instanced spheres and the asteroids against
+    // the frustum and against the depth pyramid of the previous frame, and write the survivors
+    // and their instance count for indirect draws
+    bool gpuCulling = false;
+    DepthPyramid depthPyramid;
+    DescriptorSetLayout DSLcull;
+    ComputePipeline cullCP;
+    CulledDraw sphereCull, asteroidCull;
+    glm::mat4 lastViewProj = glm::mat4(1.0f);
+    int culledFrames = 0;
 
     // Sun scale
     glm::vec3 sunScale;
@@ -118,6 +256,20 @@ protected:
     // JSON data
     json solarSystemData;
 
+public:
+    // Runs the buffer placement benchmark instead of the simulation: the window and the
+    // pipelines are created once, the benchmark is drawn and everything is released
+    void benchmarkVertices(int vertexCount) {
+        windowResizable = GLFW_FALSE;
+
+        setWindowParameters();
+        initWindow();
+        initVulkan();
+        runVertexBenchmark(vertexCount);
+        cleanup();
+    }
+
+protected:
     void setWindowParameters() {
         windowWidth = 1600;
         windowHeight = 900;
@@ -125,9 +277,27 @@ protected:
         windowResizable = GLFW_TRUE;
         initialBackgroundColor = { 0.0f, 0.0f, 0.02f, 1.0f };
 
-        uniformBlocksInPool = NUM_PLANETS + 4;  // +4 for sun, moon, ring, and skybox
-        texturesInPool = NUM_PLANETS + 4;
-        setsInPool = NUM_PLANETS + 4;
+        // The depth pyramid samples the depth buffer, which must be created for it
+        loadSolarSystemData();
+        gpuCulling = simulationFeature("gpu_culling", { "CullComp.spv", "DepthPyramidComp.spv",
+            "DepthPyramidMSComp.spv", "SpheresVert.spv", "SpheresFrag.spv" });
+        sampledDepth = gpuCulling;
+
+        // Uniform blocks are slices of the uniform ring, bound with dynamic offsets
+        uniformBlocksInPool = 0;
+        dynamicUniformBlocksInPool = NUM_PLANETS + 8;  // +4 for sun, moon, ring, and skybox, +2 for the asteroid belts, +1 for instanced spheres, +1 for the frame set
+        texturesInPool = NUM_PLANETS + 5;
+        setsInPool = NUM_PLANETS + 8;
+        storageBuffersInPool = 2;
+        if (gpuCulling) {
+            // Two culling sets with three storage buffers, a uniform block and the pyramid each,
+            // and one set per pyramid level to reduce it
+            storageBuffersInPool += 6;
+            dynamicUniformBlocksInPool += 2;
+            texturesInPool += 2 + DepthPyramid::MAX_LEVELS;
+            storageImagesInPool = DepthPyramid::MAX_LEVELS;
+            setsInPool += 2 + DepthPyramid::MAX_LEVELS;
+        }
 
         Ar = (float)windowWidth / (float)windowHeight;
     }
@@ -137,6 +307,29 @@ protected:
         Ar = (float)w / (float)h;
     }
 
+    // The packed vertex layout has its own build of each vertex shader, reading octahedral normals
+    std::string vertexShader(const std::string& name) {
+        return "shaders/" + name + (compactVertices ? "PackedVert.spv" : "Vert.spv");
+    }
+
+    // A switch of the Simulation entry that needs compiled shaders. true and false force it;
+    // "auto", the default, turns it on when every listed SPIR-V file exists (see
+    // shaders/compile.sh) and off otherwise, so a checkout without them still runs
+    bool simulationFeature(const std::string& key, const std::vector<std::string>& shaders) {
+        json value = solarSystemData["Simulation"].value(key, json("auto"));
+        if (value.is_boolean()) {
+            return value.get<bool>();
+        }
+        for (const std::string& shader : shaders) {
+            if (!std::ifstream("shaders/" + shader)) {
+                std::cout << key << ": off, shaders/" << shader << " is not compiled\n";
+                return false;
+            }
+        }
+        std::cout << key << ": on\n";
+        return true;
+    }
+
     // Loads planetery data
     void loadSolarSystemData() {
         std::ifstream file("solarSystemData.json");
@@ -146,15 +339,19 @@ protected:
     void localInit() {
         // Descriptor Layouts
         DSL.init(this, {
-            {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS},
+            {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_ALL_GRAPHICS},
             {1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT}
             });
 
         DSLskyBox.init(this, {
-            {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT},
+            {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT},
             {1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT},
             });
 
+        DSLframe.init(this, {
+            {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_ALL_GRAPHICS}
+            });
+
         // Vertex descriptors
         VD.init(this, {
             {0, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX}
@@ -175,187 +372,831 @@ protected:
                     sizeof(glm::vec3), POSITION}
             });
 
+        // Culling works on instances, so it needs the instanced spheres
+        instancedSpheres = gpuCulling || simulationFeature("instanced_spheres", { "SpheresVert.spv", "SpheresFrag.spv" });
+        splitUniforms = simulationFeature("split_uniforms", { "BodyVert.spv", "BodyFrag.spv" });
+
+        // The packed layout needs the packed build of every vertex shader reading VD or sphereVD
+        std::vector<std::string> packedShaders;
+        if (splitUniforms) {
+            packedShaders = { "BodyPackedVert.spv" };
+        }
+        else {
+            packedShaders = { "SolarSystemPackedVert.spv", "SunPackedVert.spv" };
+        }
+        if (instancedSpheres) {
+            packedShaders.push_back("SpheresPackedVert.spv");
+        }
+        compactVertices = simulationFeature("compact_vertices", packedShaders);
+        if (compactVertices) {
+            VD.usePackedLayout();
+        }
+        recordEveryFrame = solarSystemData["Simulation"].value("record_every_frame", false);
+        if (recordEveryFrame && solarSystemData["Simulation"].value("parallel_recording", false)) {
+            recordingPool = &workers;
+        }
+        std::fill(std::begin(planetVisible), std::end(planetVisible), true);
+
+        // Draws only need the index counts and radii, so the host copies can go after upload
+        bool keepGeometry = !solarSystemData["Simulation"].value("release_geometry", false);
+        for (Model<Vertex>* model : { &sun, &moon, &saturnRing, &sphere, &asteroid }) {
+            model->keepGeometry = keepGeometry;
+        }
+        for (Model<Vertex>& planet : planets) {
+            planet.keepGeometry = keepGeometry;
+        }
+        skybox.keepGeometry = keepGeometry;
+
         // Pipelines
-        P.init(this, &VD, "shaders/SolarSystemVert.spv", "shaders/SolarSystemFrag.spv", { &DSL });
-        sunP.init(this, &VD, "shaders/SunVert.spv", "shaders/SunFrag.spv", { &DSL });
+        if (splitUniforms) {
+            P.init(this, &VD, vertexShader("Body"), "shaders/BodyFrag.spv", { &DSLframe, &DSL });
+        }
+        else {
+            P.init(this, &VD, vertexShader("SolarSystem"), "shaders/SolarSystemFrag.spv", { &DSL });
+            sunP.init(this, &VD, vertexShader("Sun"), "shaders/SunFrag.spv", { &DSL });
+        }
         skyboxP.init(this, &skyboxVD, "shaders/SkyboxVert.spv", "shaders/SkyboxFrag.spv", { &DSLskyBox });
         skyboxP.setAdvancedFeatures(VK_COMPARE_OP_LESS_OR_EQUAL, VK_POLYGON_MODE_FILL,
             VK_CULL_MODE_BACK_BIT, false);
 
-        loadSolarSystemData();
-
-        // Load sun model and texture
-        sun.init(this, &VD, "Models/Sphere.gltf", GLTF);
-        if (sun.vertices.empty() || sun.indices.empty()) {
-            throw std::runtime_error("Failed to load sun model");
-        }
-        sunTexture.init(this, "textures/Sun.jpg");
-
-        // Load planet models and textures
         std::string planetNames[] = { "Mercury", "Venus", "Earth", "Mars", "Jupiter", "Saturn", "Uranus", "Neptune" };
-        for (int i = 0; i < NUM_PLANETS; i++) {
-            planets[i].init(this, &VD, "Models/Sphere.gltf", GLTF);
-            if (planets[i].vertices.empty() || planets[i].indices.empty()) {
-                throw std::runtime_error("Failed to load planet model: " + planetNames[i]);
+        if (!instancedSpheres) {
+            // Load sun model and texture
+            sun.init(this, &VD, "Models/Sphere.gltf", GLTF);
+            if (sun.indexCount == 0) {
+                throw std::runtime_error("Failed to load sun model");
+            }
+            sunTexture.init(this, "textures/Sun.jpg");
+
+            // Load planet models and textures
+            for (int i = 0; i < NUM_PLANETS; i++) {
+                planets[i].init(this, &VD, "Models/Sphere.gltf", GLTF);
+                if (planets[i].indexCount == 0) {
+                    throw std::runtime_error("Failed to load planet model: " + planetNames[i]);
+                }
+                planetTextures[i].init(this, ("textures/" + planetNames[i] + ".jpg").c_str());
             }
-            planetTextures[i].init(this, ("textures/" + planetNames[i] + ".jpg").c_str());
-        }
 
-        // Load moon model and texture
-        moon.init(this, &VD, "Models/Sphere.gltf", GLTF);
-        if (moon.vertices.empty() || moon.indices.empty()) {
-            throw std::runtime_error("Failed to load moon model");
+            // Load moon model and texture
+            moon.init(this, &VD, "Models/Sphere.gltf", GLTF);
+            if (moon.indexCount == 0) {
+                throw std::runtime_error("Failed to load moon model");
+            }
+            moonTexture.init(this, "textures/Moon.jpg");
         }
-        moonTexture.init(this, "textures/Moon.jpg");
 
         // Load saturn ring model and texture
         saturnRing.init(this, &VD, "Models/saturnRing.obj", OBJ);
-        if (saturnRing.vertices.empty() || saturnRing.indices.empty()) {
+        if (saturnRing.indexCount == 0) {
             throw std::runtime_error("Failed to load ring model");
         }
         saturnRingTexture.init(this, "textures/ringAlpha.png");
 
         // Load skybox model and texture
         skybox.init(this, &skyboxVD, "Models/SkyBoxCube.obj", OBJ);
-        if (skybox.vertices.empty() || skybox.indices.empty()) {
+        if (skybox.indexCount == 0) {
             throw std::runtime_error("Failed to load skybox model");
         }
         skyboxTexture.init(this, "Textures/Skybox.jpg");
 
-        // Set planet properties based on JSON data
+        // Set planet and moon properties based on JSON data. The planets come first, ordered
+        // by distance from the sun, so planet i is ephemeris body i.
+        solarSystem.load(solarSystemData);
         for (int i = 0; i < NUM_PLANETS; i++) {
-            const auto& planetData = solarSystemData[planetNames[i]];
-            planetProps[i].orbitRadius = planetData["distance_from_sun"];
-            planetProps[i].revolutionSpeed = 1.0f / planetData["revolution_period"].get<float>();
-            planetProps[i].rotationSpeed = 1.0f / planetData["rotation_period"].get<float>();
-            planetProps[i].eclipticInclination = glm::radians(planetData["ecliptic_inclination"].get<float>());
-            planetProps[i].axialTilt = glm::radians(planetData["axial_tilt"].get<float>());
-            planetProps[i].scale = glm::vec3(planetData["radius"].get<float>());
-        }
-
-        // Set moon properties
-        const auto& moonData = solarSystemData["Moon"];
-        moonProps.orbitRadius = moonData["distance_from_planet"];
-        moonProps.revolutionSpeed = 1.0f / moonData["revolution_period"].get<float>();
-        moonProps.rotationSpeed = 1.0f / moonData["rotation_period"].get<float>();
-        moonProps.scale = glm::vec3(moonData["radius"].get<float>());
+            if (solarSystem.bodyIndex(planetNames[i]) != i) {
+                throw std::runtime_error("Unexpected order of planets in solarSystemData.json");
+            }
+        }
+        moonIndex = solarSystem.bodyIndex("Moon");
+
+        // The keyframes are built in the background, until then positions are computed directly
+        ephemerisCache.build(ephemeris);
 
         // Set sun scale
         sunScale = glm::vec3(solarSystemData["Sun"]["radius"].get<float>());
+
+        // Build the transform hierarchy. Planet orbit nodes are roots rather than children of
+        // the sun, since in N-body mode their positions are already absolute.
+        sunOrbitNode = scene.addNode();
+        sunNode = scene.addNode(sunOrbitNode, glm::scale(glm::mat4(1.0f), sunScale));
+        for (int i = 0; i < ephemeris.count; i++) {
+            orbitNode.push_back(scene.addNode(solarSystem.parent[i] >= 0 ? orbitNode[solarSystem.parent[i]] : -1));
+            bodyNode.push_back(scene.addNode(orbitNode[i]));
+        }
+        saturnRingNode = scene.addNode(orbitNode[solarSystem.bodyIndex("Saturn")],
+            glm::rotate(glm::mat4(1.0f), 59.6f, glm::vec3(0, 1, 0)) *
+            glm::scale(glm::mat4(1.0f), glm::vec3(0.18f)));
+
+        if (instancedSpheres) {
+            initInstancedSpheres();
+        }
+        sphereRadius = (instancedSpheres ? sphere : sun).radius;
+        saturnRingRadius = saturnRing.radius;
+
+        gpuBelts = simulationFeature("gpu_belts", { "AsteroidComp.spv", "AsteroidVert.spv", "AsteroidFrag.spv" });
+        if (gpuBelts) {
+            initAsteroidBelts();
+        }
+        if (gpuCulling) {
+            initCulling();
+        }
+    }
+
+    // Sets up the culling pipeline, the depth pyramid, and the output buffers of each culled draw
+    void initCulling() {
+        DSLcull.init(this, {
+            {0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+            {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+            {2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+            {3, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT},
+            {4, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT}
+            });
+        cullCP.init(this, "shaders/CullComp.spv", { &DSLcull });
+        depthPyramid.init(this, "shaders/DepthPyramidComp.spv", "shaders/DepthPyramidMSComp.spv");
+
+        initCulledDraw(sphereCull, sizeof(SphereInstance) * sphereInstanceData.size(), sphere);
+        // Bounds come from the model matrices on the device, nothing is computed per instance on the CPU
+        sphereCull.ubo.instances = glm::uvec4(sphereInstanceData.size(), sizeof(SphereInstance) / 4,
+            offsetof(SphereInstance, model) / 4, 1);
+        sphereCull.ubo.radiusScale = sphereRadius;
+        if (gpuBelts) {
+            // Each asteroid is a vec4 of position and size, a multiple of the mesh radius
+            initCulledDraw(asteroidCull, sizeof(glm::vec4) * asteroidCount, asteroid);
+            asteroidCull.ubo.instances = glm::uvec4(asteroidCount, 4, 0, 0);
+            asteroidCull.ubo.radiusScale = asteroid.radius;
+        }
+    }
+
+    void initCulledDraw(CulledDraw& cull, VkDeviceSize instanceBytes, const Model<Vertex>& model) {
+        VkDrawIndexedIndirectCommand command{ model.indexCount, 0, 0, 0, 0 };
+        cull.visible.init(this, instanceBytes, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+        cull.indirect.init(this, sizeof(command), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, &command);
+    }
+
+    // Loads the sphere mesh once and the textures of the sun and of every body as layers of one array
+    void initInstancedSpheres() {
+        // Binding 0 is the sphere mesh, binding 1 the model matrix and material of each body
+        sphereVD.init(this, {
+            {0, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX},
+            {1, sizeof(SphereInstance), VK_VERTEX_INPUT_RATE_INSTANCE}
+            }, {
+                {0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, pos),
+                    sizeof(glm::vec3), POSITION},
+                {0, 1, VK_FORMAT_R32G32_SFLOAT, offsetof(Vertex, UV),
+                    sizeof(glm::vec2), UV},
+                {0, 2, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, normal),
+                    sizeof(glm::vec3), NORMAL},
+                {1, 3, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(SphereInstance, model),
+                    sizeof(glm::vec4), OTHER},
+                {1, 4, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(SphereInstance, model) + sizeof(glm::vec4),
+                    sizeof(glm::vec4), OTHER},
+                {1, 5, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(SphereInstance, model) + 2 * sizeof(glm::vec4),
+                    sizeof(glm::vec4), OTHER},
+                {1, 6, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(SphereInstance, model) + 3 * sizeof(glm::vec4),
+                    sizeof(glm::vec4), OTHER},
+                {1, 7, VK_FORMAT_R32G32_UINT, offsetof(SphereInstance, material),
+                    sizeof(glm::uvec2), OTHER}
+            });
+        if (compactVertices) {
+            sphereVD.usePackedLayout();
+        }
+        sphereP.init(this, &sphereVD, vertexShader("Spheres"), "shaders/SpheresFrag.spv", { &DSL });
+
+        sphere.init(this, &sphereVD, "Models/Sphere.gltf", GLTF);
+        if (sphere.indexCount == 0) {
+            throw std::runtime_error("Failed to load sphere model");
+        }
+
+        std::vector<std::string> textureFiles = { "textures/Sun.jpg" };
+        for (const std::string& name : solarSystem.names) {
+            textureFiles.push_back("textures/" + name + ".jpg");
+        }
+        sphereTextures.initArray(this, textureFiles);
+
+        sphereInstanceData.resize(ephemeris.count + 1);
+        for (int i = 0; i <= ephemeris.count; i++) {
+            sphereInstanceData[i].material = glm::uvec2(i, i == 0 ? 1 : 0);
+        }
+    }
+
+    // Generates the orbital elements of the main and Kuiper belt asteroids once, uploads them to
+    // device local memory and sets up the compute and instanced draw pipelines that use them
+    void initAsteroidBelts() {
+        DSLasteroidCompute.init(this, {
+            {0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+            {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+            {2, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT}
+            });
+        DSLasteroid.init(this, {
+            {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_ALL_GRAPHICS}
+            });
+
+        // Binding 0 is the asteroid mesh, binding 1 the position and size of each asteroid
+        asteroidVD.init(this, {
+            {0, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX},
+            {1, sizeof(glm::vec4), VK_VERTEX_INPUT_RATE_INSTANCE}
+            }, {
+                {0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, pos),
+                    sizeof(glm::vec3), POSITION},
+                {0, 1, VK_FORMAT_R32G32_SFLOAT, offsetof(Vertex, UV),
+                    sizeof(glm::vec2), UV},
+                {0, 2, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, normal),
+                    sizeof(glm::vec3), NORMAL},
+                {1, 3, VK_FORMAT_R32G32B32A32_SFLOAT, 0,
+                    sizeof(glm::vec4), OTHER}
+            });
+
+        asteroidCP.init(this, "shaders/AsteroidComp.spv", { &DSLasteroidCompute });
+        asteroidP.init(this, &asteroidVD, "shaders/AsteroidVert.spv", "shaders/AsteroidFrag.spv", { &DSLasteroid });
+
+        // Asteroids are drawn as small octahedra
+        const glm::vec3 corners[6] = { {1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1} };
+        for (const glm::vec3& c : corners) {
+            asteroid.vertices.push_back({ c, glm::vec2(0.0f), c });
+        }
+        asteroid.indices = { 0, 2, 4,  2, 1, 4,  1, 3, 4,  3, 0, 4,  2, 0, 5,  1, 2, 5,  3, 1, 5,  0, 3, 5 };
+        asteroid.initMesh(this, &asteroidVD);
+
+        // Mean motion from Kepler's third law, matched to Earth's orbit
+        const auto& earthData = solarSystemData["Earth"];
+        float earthRadius = earthData["distance_from_sun"].get<float>();
+        float earthSpeed = 1.0f / earthData["revolution_period"].get<float>();
+        const float turn = glm::radians(360.0f);
+
+        std::vector<AsteroidOrbit> orbits;
+        std::mt19937 rng(11);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        for (const char* beltName : { "Asteroid Belt", "Kuiper Belt" }) {
+            const auto& beltData = solarSystemData[beltName];
+            int count = beltData["gpu_count"].get<int>();
+            float innerRadius = beltData["inner_radius"].get<float>();
+            float outerRadius = beltData["outer_radius"].get<float>();
+            float maxInclination = glm::radians(beltData["max_inclination"].get<float>());
+            float maxEccentricity = beltData["max_eccentricity"].get<float>();
+            float size = beltData["size"].get<float>();
+            for (int i = 0; i < count; i++) {
+                float a = innerRadius + (outerRadius - innerRadius) * unit(rng);
+                float e = maxEccentricity * unit(rng);
+                float incl = maxInclination * (2.0f * unit(rng) - 1.0f);
+                float periapsisArg = turn * unit(rng), node = turn * unit(rng);
+
+                // Same perifocal axes as the ephemeris, in the y-up world frame
+                float so = sin(periapsisArg), co = cos(periapsisArg);
+                float sn = sin(node), cn = cos(node);
+                float si = sin(incl), ci = cos(incl);
+                float b = a * std::sqrt(1.0f - e * e);
+
+                AsteroidOrbit o;
+                o.periapsis = glm::vec4(a * (cn * co - sn * so * ci), a * (so * si),
+                    a * (sn * co + cn * so * ci), e);
+                o.minorAxis = glm::vec4(b * (-cn * so - sn * co * ci), b * (co * si),
+                    b * (-sn * so + cn * co * ci), size * (0.5f + unit(rng)));
+                double meanMotion = earthSpeed * std::pow((double)a / earthRadius, -1.5) / turn;
+                float meanMotionHigh = splitHigh(meanMotion);
+                o.phase = glm::vec4(unit(rng), meanMotionHigh, (float)(meanMotion - meanMotionHigh), 0.0f);
+                orbits.push_back(o);
+            }
+        }
+        asteroidCount = (int)orbits.size();
+
+        asteroidOrbits.init(this, sizeof(AsteroidOrbit) * orbits.size(), 0, orbits.data());
+        asteroidInstances.init(this, sizeof(glm::vec4) * orbits.size(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+        std::cout << "GPU asteroid belts: " << asteroidCount << " asteroids\n";
+    }
+
+    // Seeds the N-body system with the sun, the planets where they currently are, and the asteroid belt.
+    // Body 0 is the sun and body i + 1 is planet i; every body starts on a circular orbit around the sun.
+    void seedNBody() {
+        const auto& sunData = solarSystemData["Sun"];
+        const auto& earthData = solarSystemData["Earth"];
+
+        // Gravitational constant such that Earth's circular orbit keeps its period
+        double earthRadius = earthData["distance_from_sun"].get<double>();
+        double earthSpeed = 1.0 / earthData["revolution_period"].get<double>();
+        double sunMass = sunData["mass"].get<double>();
+        nbody.clear();
+        nbody.pool = &workers;
+        nbody.G = earthSpeed * earthSpeed * earthRadius * earthRadius * earthRadius / sunMass;
+        const auto& simulationData = solarSystemData["Simulation"];
+        nbody.tickRate = simulationData["tick_rate"].get<double>();
+        nbody.integrator = simulationData["integrator"].get<std::string>() == "yoshida" ?
+            NBodySystem::YOSHIDA4 : NBodySystem::LEAPFROG;
+        nbody.softening = 0.01;
+
+        nbody.addBody(glm::vec3(0.0f), glm::vec3(0.0f), sunMass);
+
+        for (int i = 0; i < NUM_PLANETS; i++) {
+            nbody.addOrbitingBody(0, ephemeris.position(i), ephemeris.orbitNormal(i),
+                solarSystemData[solarSystem.names[i]]["mass"].get<double>());
+        }
+
+        const auto& beltData = solarSystemData["Asteroid Belt"];
+        int asteroids = beltData["count"].get<int>();
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> radius(beltData["inner_radius"].get<float>(), beltData["outer_radius"].get<float>());
+        std::uniform_real_distribution<float> angle(0.0f, glm::radians(360.0f));
+        std::uniform_real_distribution<float> inclination(-1.0f, 1.0f);
+        float maxInclination = glm::radians(beltData["max_inclination"].get<float>());
+        double asteroidMass = asteroids > 0 ? beltData["mass"].get<double>() / asteroids : 0.0;
+        for (int i = 0; i < asteroids; i++) {
+            float r = radius(rng), theta = angle(rng), incl = maxInclination * inclination(rng);
+            glm::vec3 position(r * cos(theta), r * sin(incl) * sin(theta), r * cos(incl) * sin(theta));
+            nbody.addOrbitingBody(0, position, glm::vec3(0.0f, -cos(incl), sin(incl)), asteroidMass);
+        }
+
+        nbody.removeNetMomentum();
+        nbody.setTime(accumulatedTime);
     }
 
     void pipelinesAndDescriptorSetsInit() {
         P.create();
-        sunP.create();
+        if (!splitUniforms) {
+            sunP.create();
+        }
         skyboxP.create();
 
-        // Create descriptor sets for sun, planets, moon, ship, and skybox
-        sunDS.init(this, &DSL, {
-            {0, UNIFORM, sizeof(UniformBlock), nullptr},
-            {1, TEXTURE, 0, &sunTexture}
-            });
+        // The blocks of the objects drawn with P hold everything, or only their matrices
+        int objectBlockSize = splitUniforms ? sizeof(ObjectUniformBlock) : sizeof(UniformBlock);
+        if (splitUniforms) {
+            frameDS.init(this, &DSLframe, {
+                {0, UNIFORM_DYNAMIC, sizeof(FrameUniformBlock), nullptr}
+                });
+        }
 
-        // Create descriptor sets for planets
-        for (int i = 0; i < NUM_PLANETS; i++) {
-            planetDS[i].init(this, &DSL, {
-                {0, UNIFORM, sizeof(UniformBlock), nullptr},
-                {1, TEXTURE, 0, &planetTextures[i]}
+        if (instancedSpheres) {
+            sphereP.create();
+            sphereDS.init(this, &DSL, {
+                {0, UNIFORM_DYNAMIC, sizeof(FrameUniformBlock), nullptr},
+                {1, TEXTURE, 0, &sphereTextures}
                 });
+            sphereInstances.init(this, sizeof(SphereInstance) * sphereInstanceData.size());
         }
+        else {
+            // Create descriptor sets for sun, planets, moon, ship, and skybox
+            sunDS.init(this, &DSL, {
+                {0, UNIFORM_DYNAMIC, objectBlockSize, nullptr},
+                {1, TEXTURE, 0, &sunTexture}
+                });
 
-        // Create descriptor set for moon
-        moonDS.init(this, &DSL, {
-            {0, UNIFORM, sizeof(UniformBlock), nullptr},
-            {1, TEXTURE, 0, &moonTexture}
-            });
+            // Create descriptor sets for planets
+            for (int i = 0; i < NUM_PLANETS; i++) {
+                planetDS[i].init(this, &DSL, {
+                    {0, UNIFORM_DYNAMIC, objectBlockSize, nullptr},
+                    {1, TEXTURE, 0, &planetTextures[i]}
+                    });
+            }
+
+            // Create descriptor set for moon
+            moonDS.init(this, &DSL, {
+                {0, UNIFORM_DYNAMIC, objectBlockSize, nullptr},
+                {1, TEXTURE, 0, &moonTexture}
+                });
+        }
 
         // Create descriptor set for Saturns ring
         saturnRingDS.init(this, &DSL, {
-            {0, UNIFORM, sizeof(UniformBlock), nullptr},
+            {0, UNIFORM_DYNAMIC, objectBlockSize, nullptr},
             {1, TEXTURE, 0, &saturnRingTexture}
             });
 
         // Create descriptor set for skyBox
         skyboxDS.init(this, &DSLskyBox, {
-            {0, UNIFORM, sizeof(skyBoxUniformBufferObject), nullptr},
+            {0, UNIFORM_DYNAMIC, sizeof(skyBoxUniformBufferObject), nullptr},
             {1, TEXTURE, 0, &skyboxTexture}
             });
+
+        if (gpuBelts) {
+            asteroidCP.create();
+            asteroidP.create();
+            asteroidComputeDS.init(this, &DSLasteroidCompute, {
+                {0, STORAGE, 0, nullptr, &asteroidOrbits},
+                {1, STORAGE, 0, nullptr, &asteroidInstances},
+                {2, UNIFORM_DYNAMIC, sizeof(AsteroidUniformBlock), nullptr}
+                });
+            asteroidDS.init(this, &DSLasteroid, {
+                {0, UNIFORM_DYNAMIC, sizeof(AsteroidUniformBlock), nullptr}
+                });
+        }
+
+        if (gpuCulling) {
+            // The new depth buffer holds nothing yet, so occlusion waits for a frame to be drawn
+            depthPyramid.create();
+            cullCP.create();
+            sphereCull.DS.init(this, &DSLcull, {
+                {0, STORAGE, 0, nullptr, nullptr, &sphereInstances},
+                {1, STORAGE, 0, nullptr, &sphereCull.visible},
+                {2, STORAGE, 0, nullptr, &sphereCull.indirect},
+                {3, UNIFORM_DYNAMIC, sizeof(CullUniformBlock), nullptr},
+                {4, TEXTURE, 0, &depthPyramid.texture}
+                });
+            if (gpuBelts) {
+                asteroidCull.DS.init(this, &DSLcull, {
+                    {0, STORAGE, 0, nullptr, &asteroidInstances},
+                    {1, STORAGE, 0, nullptr, &asteroidCull.visible},
+                    {2, STORAGE, 0, nullptr, &asteroidCull.indirect},
+                    {3, UNIFORM_DYNAMIC, sizeof(CullUniformBlock), nullptr},
+                    {4, TEXTURE, 0, &depthPyramid.texture}
+                    });
+            }
+            culledFrames = 0;
+        }
+
+        buildDrawList();
+    }
+
+    // Draws a mesh of degenerate triangles, so that only vertex fetch and shading take time,
+    // from device local and from host visible buffers, and prints the vertex rate of each
+    void runVertexBenchmark(int vertexCount) {
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        std::vector<Vertex> vertices;
+        std::vector<uint32_t> indices;
+        for (int i = 0; i + 3 <= vertexCount; i += 3) {
+            glm::vec3 p(unit(rng), unit(rng), unit(rng));
+            for (int k = 0; k < 3; k++) {
+                vertices.push_back({ p, glm::vec2(0.0f), glm::vec3(0.0f, 1.0f, 0.0f) });
+                indices.push_back(i + k);
+            }
+        }
+
+        View = ViewMatrix;
+        glm::mat4 Prj = glm::perspective(glm::radians(45.0f), Ar, nearPlane, farPlane);
+        mapObjectUniforms(0, saturnRingDS, saturnRingUBO, glm::mat4(1.0f), false, Prj, glm::vec3(0.0f));
+        if (splitUniforms) {
+            frameUBO.view = View;
+            frameUBO.proj = Prj;
+            frameUBO.lightPos = glm::vec3(0.0f);
+            frameDS.map(0, &frameUBO, sizeof(frameUBO), 0);
+        }
+
+        const int draws = 100;
+        for (bool hostVisible : { false, true }) {
+            Model<Vertex> mesh;
+            mesh.hostVisible = hostVisible;
+            mesh.vertices = vertices;
+            mesh.indices = indices;
+            mesh.initMesh(this, &VD);
+            uploads.wait(uploads.pending());
+
+            // The first run warms up, the second is timed
+            double seconds = 0.0;
+            for (int run = 0; run < 2; run++) {
+                VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+                beginRenderPass(commandBuffer, 0, VK_SUBPASS_CONTENTS_INLINE);
+                P.bind(commandBuffer);
+                if (splitUniforms) {
+                    frameDS.bind(commandBuffer, P, 0, 0);
+                }
+                saturnRingDS.bind(commandBuffer, P, splitUniforms ? 1 : 0, 0);
+                mesh.bind(commandBuffer);
+                for (int d = 0; d < draws; d++) {
+                    vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(indices.size()), 1, 0, 0, 0);
+                }
+                vkCmdEndRenderPass(commandBuffer);
+
+                auto start = std::chrono::high_resolution_clock::now();
+                endSingleTimeCommands(commandBuffer);
+                auto end = std::chrono::high_resolution_clock::now();
+                seconds = std::chrono::duration<double>(end - start).count();
+            }
+            mesh.cleanup();
+
+            std::cout << "Vertex benchmark, " << (hostVisible ? "host visible" : "device local") << ": "
+                << indices.size() << " vertices x " << draws << " draws, " << seconds * 1000.0 << " ms, "
+                << (double)indices.size() * draws / seconds / 1e6 << " Mvertices/s" << std::endl;
+        }
     }
 
     void pipelinesAndDescriptorSetsCleanup() {
         P.cleanup();
-        sunP.cleanup();
+        if (splitUniforms) {
+            frameDS.cleanup();
+        }
+        else {
+            sunP.cleanup();
+        }
         skyboxP.cleanup();
-        sunDS.cleanup();
-        for (int i = 0; i < NUM_PLANETS; i++) {
-            planetDS[i].cleanup();
+        if (instancedSpheres) {
+            sphereP.cleanup();
+            sphereDS.cleanup();
+            sphereInstances.cleanup();
+        }
+        else {
+            sunDS.cleanup();
+            for (int i = 0; i < NUM_PLANETS; i++) {
+                planetDS[i].cleanup();
+            }
+            moonDS.cleanup();
         }
-        moonDS.cleanup();
         saturnRingDS.cleanup();
         skyboxDS.cleanup();
+        if (gpuBelts) {
+            asteroidCP.cleanup();
+            asteroidP.cleanup();
+            asteroidComputeDS.cleanup();
+            asteroidDS.cleanup();
+        }
+        if (gpuCulling) {
+            depthPyramid.cleanup();
+            cullCP.cleanup();
+            sphereCull.DS.cleanup();
+            if (gpuBelts) {
+                asteroidCull.DS.cleanup();
+            }
+        }
     }
 
     void localCleanup() {
-        sunTexture.cleanup();
-        sun.cleanup();
-        for (int i = 0; i < NUM_PLANETS; i++) {
-            planetTextures[i].cleanup();
-            planets[i].cleanup();
+        if (instancedSpheres) {
+            sphereTextures.cleanup();
+            sphere.cleanup();
+            sphereP.destroy();
+        }
+        else {
+            sunTexture.cleanup();
+            sun.cleanup();
+            for (int i = 0; i < NUM_PLANETS; i++) {
+                planetTextures[i].cleanup();
+                planets[i].cleanup();
+            }
+            moonTexture.cleanup();
+            moon.cleanup();
         }
-        moonTexture.cleanup();
-        moon.cleanup();
         saturnRingTexture.cleanup();
         saturnRing.cleanup();
         skyboxTexture.cleanup();
         skybox.cleanup();
         DSL.cleanup();
         DSLskyBox.cleanup();
+        DSLframe.cleanup();
         P.destroy();
-        sunP.destroy();
+        if (!splitUniforms) {
+            sunP.destroy();
+        }
         skyboxP.destroy();
+        if (gpuBelts) {
+            asteroid.cleanup();
+            asteroidOrbits.cleanup();
+            asteroidInstances.cleanup();
+            DSLasteroidCompute.cleanup();
+            DSLasteroid.cleanup();
+            asteroidCP.destroy();
+            asteroidP.destroy();
+        }
+        if (gpuCulling) {
+            depthPyramid.destroy();
+            cullCP.destroy();
+            DSLcull.cleanup();
+            sphereCull.visible.cleanup();
+            sphereCull.indirect.cleanup();
+            if (gpuBelts) {
+                asteroidCull.visible.cleanup();
+                asteroidCull.indirect.cleanup();
+            }
+        }
     }
 
-    void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
-        // Draw skybox first
-        skyboxP.bind(commandBuffer);
-        skybox.bind(commandBuffer);
-        skyboxDS.bind(commandBuffer, skyboxP, 0, currentImage);
-        vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(skybox.indices.size()), 1, 0, 0, 0);
+    void populateComputeCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
+        if (gpuBelts) {
+            // The previous frame's draw, or its culling pass, must have read the positions
+            // before they are overwritten
+            asteroidInstances.barrier(commandBuffer,
+                VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0);
+
+            asteroidCP.bind(commandBuffer);
+            asteroidComputeDS.bind(commandBuffer, asteroidCP, 0, currentImage);
+            asteroidCP.dispatch(commandBuffer, asteroidCount, 64);
+
+            asteroidInstances.barrier(commandBuffer,
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+                VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_SHADER_READ_BIT);
+        }
 
-        // Draw sun
-        if (!sun.vertices.empty() && !sun.indices.empty()) {
-            sunP.bind(commandBuffer);
-            sunDS.bind(commandBuffer, sunP, 0, currentImage);
-            sun.bind(commandBuffer);
-            vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(sun.indices.size()), 1, 0, 0, 0);
+        if (gpuCulling) {
+            // The depth buffer still holds the previous frame
+            depthPyramid.build(commandBuffer);
+            recordCulling(commandBuffer, currentImage, sphereCull, static_cast<uint32_t>(sphereInstanceData.size()));
+            if (gpuBelts) {
+                recordCulling(commandBuffer, currentImage, asteroidCull, asteroidCount);
+            }
         }
+    }
 
-        // Draw planets, moon
-        P.bind(commandBuffer);
+    // Resets the instance count of a culled draw and lets Cull.comp fill it again
+    void recordCulling(VkCommandBuffer commandBuffer, int currentImage, CulledDraw& cull, uint32_t count) {
+        // The previous frame's draw must be done with both buffers before they are rewritten
+        cull.indirect.barrier(commandBuffer,
+            VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+        cull.visible.barrier(commandBuffer,
+            VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0);
+        vkCmdFillBuffer(commandBuffer, cull.indirect.buffer,
+            offsetof(VkDrawIndexedIndirectCommand, instanceCount), sizeof(uint32_t), 0);
+        cull.indirect.barrier(commandBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
+        cullCP.bind(commandBuffer);
+        cull.DS.bind(commandBuffer, cullCP, 0, currentImage);
+        cullCP.dispatch(commandBuffer, count, 64);
+
+        cull.indirect.barrier(commandBuffer,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+            VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+        cull.visible.barrier(commandBuffer,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+            VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+    }
 
-        // Draw planets
-        for (int i = 0; i < NUM_PLANETS; i++) {
-            if (!planets[i].vertices.empty() && !planets[i].indices.empty()) {
-                planetDS[i].bind(commandBuffer, P, 0, currentImage);
-                planets[i].bind(commandBuffer);
-                vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(planets[i].indices.size()), 1, 0, 0, 0);
+    // Queue of the render pass, rebuilt from the visible set and sorted every frame. The skybox
+    // covers only what the opaque draws left empty, so it runs after them, and the ring blends
+    // over what is behind it, so it runs last.
+    void buildDrawList() {
+        drawQueue.clear();
+        if (instancedSpheres) {
+            pushDraw({ DRAW_SPHERES, &sphereP, &sphereDS, &sphere }, OPAQUE_PASS, sunOrbitNode);
+        }
+        else {
+            // With split uniforms the sun shares the planet pipeline
+            if (sunVisible) {
+                pushDraw({ DRAW_BODY, splitUniforms ? &P : &sunP, &sunDS, &sun }, OPAQUE_PASS, sunNode);
+            }
+            for (int i = 0; i < NUM_PLANETS; i++) {
+                if (planetVisible[i]) {
+                    pushDraw({ DRAW_BODY, &P, &planetDS[i], &planets[i] }, OPAQUE_PASS, bodyNode[i]);
+                }
+            }
+            if (moonVisible) {
+                pushDraw({ DRAW_BODY, &P, &moonDS, &moon }, OPAQUE_PASS, bodyNode[moonIndex]);
             }
         }
+        if (gpuBelts) {
+            pushDraw({ DRAW_ASTEROIDS, &asteroidP, &asteroidDS, &asteroid }, OPAQUE_PASS, sunOrbitNode);
+        }
+        pushDraw({ DRAW_SKYBOX, &skyboxP, &skyboxDS, nullptr }, BACKGROUND_PASS, -1);
+        if (saturnRingVisible) {
+            pushDraw({ DRAW_BODY, &P, &saturnRingDS, &saturnRing }, TRANSPARENT_PASS, saturnRingNode);
+        }
+        drawQueue.sort();
+    }
 
-        // Draw moon
-        if (!moon.vertices.empty() && !moon.indices.empty()) {
-            moonDS.bind(commandBuffer, P, 0, currentImage);
-            moon.bind(commandBuffer);
-            vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(moon.indices.size()), 1, 0, 0, 0);
+    // Queues a draw keyed by its pipeline, its mesh and the camera distance of a scene node
+    void pushDraw(const DrawItem& item, RenderPass pass, int node) {
+        float depth = 1.0f;
+        if (node >= 0) {
+            depth = glm::length(glm::vec3(ViewMatrix * scene.world[node][3])) / farPlane;
         }
+        drawQueue.push(item, pass, item.pipeline, (const void*)meshBuffer(item), depth);
+    }
 
-        // Draw saturn ring
-        if (!saturnRing.vertices.empty() && !saturnRing.indices.empty()) {
-            saturnRingDS.bind(commandBuffer, P, 0, currentImage);
-            saturnRing.bind(commandBuffer);
-            vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(saturnRing.indices.size()), 1, 0, 0, 0);
+    VkBuffer meshBuffer(const DrawItem& item) {
+        return item.model ? item.model->meshBuffer() : skybox.meshBuffer();
+    }
+
+    void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
+        if (recordedDrawOrder.size() < swapChainImages.size()) {
+            recordedDrawOrder.resize(swapChainImages.size());
+        }
+        recordedDrawOrder[currentImage] = drawQueue.drawOrder();
+        populateDrawRange(commandBuffer, currentImage, 0, static_cast<int>(drawQueue.size()));
+    }
+
+    bool commandBufferOutdated(int currentImage) {
+        return currentImage >= (int)recordedDrawOrder.size() ||
+            recordedDrawOrder[currentImage] != drawQueue.drawOrder();
+    }
+
+    int drawListSize(int currentImage) {
+        return static_cast<int>(drawQueue.size());
+    }
+
+    void populateDrawRange(VkCommandBuffer commandBuffer, int currentImage, int begin, int end) {
+        // Pipelines, descriptor sets and meshes are bound only when they change. With split
+        // uniforms the camera and the light are bound with P, at set 0, and stay bound while
+        // each object binds its own set 1.
+        int objectSet = splitUniforms ? 1 : 0;
+        Pipeline* bound = nullptr;
+        DescriptorSet* boundDS = nullptr;
+        VkBuffer boundMesh = VK_NULL_HANDLE;
+        for (int d = begin; d < end; d++) {
+            const DrawItem& item = drawQueue[d];
+            if (item.pipeline != bound) {
+                bound = item.pipeline;
+                bound->bind(commandBuffer);
+                boundDS = nullptr;
+                if (splitUniforms && bound == &P) {
+                    frameDS.bind(commandBuffer, P, 0, currentImage);
+                }
+            }
+            if (item.DS != boundDS) {
+                boundDS = item.DS;
+                boundDS->bind(commandBuffer, *item.pipeline, item.kind == DRAW_BODY ? objectSet : 0, currentImage);
+            }
+            if (meshBuffer(item) != boundMesh) {
+                boundMesh = meshBuffer(item);
+                if (item.model) {
+                    item.model->bind(commandBuffer);
+                }
+                else {
+                    skybox.bind(commandBuffer);
+                }
+            }
+
+            switch (item.kind) {
+            case DRAW_SKYBOX:
+                vkCmdDrawIndexed(commandBuffer, skybox.indexCount, 1, 0, 0, 0);
+                break;
+
+            // Sun, planets and moon as instances of one sphere
+            case DRAW_SPHERES: {
+                if (gpuCulling) {
+                    sphereCull.visible.bindAsVertexBuffer(commandBuffer, 1);
+                    vkCmdDrawIndexedIndirect(commandBuffer, sphereCull.indirect.buffer, 0, 1,
+                        sizeof(VkDrawIndexedIndirectCommand));
+                    break;
+                }
+                sphereInstances.bind(commandBuffer, 1, currentImage);
+                size_t instances = recordEveryFrame ? visibleSphereInstances.size() : sphereInstanceData.size();
+                vkCmdDrawIndexed(commandBuffer, sphere.indexCount,
+                    static_cast<uint32_t>(instances), 0, 0, 0);
+                break;
+            }
+
+            case DRAW_BODY:
+                vkCmdDrawIndexed(commandBuffer, item.model->indexCount, 1, 0, 0, 0);
+                break;
+
+            // Every asteroid in one instanced call, positions come from the compute pass
+            case DRAW_ASTEROIDS:
+                if (gpuCulling) {
+                    asteroidCull.visible.bindAsVertexBuffer(commandBuffer, 1);
+                    vkCmdDrawIndexedIndirect(commandBuffer, asteroidCull.indirect.buffer, 0, 1,
+                        sizeof(VkDrawIndexedIndirectCommand));
+                    break;
+                }
+                asteroidInstances.bindAsVertexBuffer(commandBuffer, 1);
+                vkCmdDrawIndexed(commandBuffer, asteroid.indexCount, asteroidCount, 0, 0, 0);
+                break;
+            }
         }
+    }
 
+    // x rounded to 12 significant bits, so the float product of two such values is exact
+    static float splitHigh(double x) {
+        int exponent;
+        double mantissa = std::frexp(x, &exponent);
+        return (float)std::ldexp(std::trunc(std::ldexp(mantissa, 12)), exponent - 12);
+    }
+
+    // World bounding sphere of a mesh placed by a model matrix, scaled by its largest axis
+    static glm::vec4 boundingSphere(const glm::mat4& model, float radius) {
+        float scale = std::max(glm::length(glm::vec3(model[0])),
+            std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+        return glm::vec4(glm::vec3(model[3]), radius * scale);
+    }
+
+    static bool inView(const Frustum& frustum, const glm::mat4& model, float radius) {
+        glm::vec4 bounds = boundingSphere(model, radius);
+        return frustum.intersectsSphere(glm::vec3(bounds), bounds.w);
+    }
+
+    void mapCullUniforms(uint32_t currentImage, CulledDraw& cull, const Frustum& frustum) {
+        cull.ubo.pyramidViewProj = lastViewProj;
+        std::copy(std::begin(frustum.planes), std::end(frustum.planes), cull.ubo.planes);
+        cull.ubo.pyramid = glm::vec4(depthPyramid.width, depthPyramid.height, depthPyramid.levels,
+            culledFrames > 0 ? 1.0f : 0.0f);
+        cull.DS.map(currentImage, &cull.ubo, sizeof(cull.ubo), 3);
+    }
+
+    // Uniform block of one object drawn with P or sunP: the whole block, or with split
+    // uniforms only its matrices, since the camera and the light are in the frame set
+    void mapObjectUniforms(uint32_t currentImage, DescriptorSet& DS, UniformBlock& ubo,
+        const glm::mat4& model, bool emissive, const glm::mat4& Prj, const glm::vec3& lightPos) {
+        if (splitUniforms) {
+            ObjectUniformBlock object;
+            object.model = model;
+            object.normal = glm::transpose(glm::inverse(model));
+            object.material = glm::uvec4(emissive ? 1 : 0, 0, 0, 0);
+            DS.map(currentImage, &object, sizeof(object), 0);
+            return;
+        }
+        ubo.model = model;
+        ubo.view = View;
+        ubo.proj = Prj;
+        ubo.lightPos = lightPos;
+        DS.map(currentImage, &ubo, sizeof(ubo), 0);
+    }
+
+    // Uniform blocks of the sun, planets and moon when each one is drawn on its own
+    void updateBodyUniforms(uint32_t currentImage, const glm::mat4& Prj, const glm::vec3& lightPos) {
+        mapObjectUniforms(currentImage, sunDS, sunUBO, scene.world[sunNode], true, Prj, lightPos);
+        for (int i = 0; i < NUM_PLANETS; i++) {
+            mapObjectUniforms(currentImage, planetDS[i], planetUBO[i], scene.world[bodyNode[i]], false, Prj, lightPos);
+        }
+        mapObjectUniforms(currentImage, moonDS, moonUBO, scene.world[bodyNode[moonIndex]], false, Prj, lightPos);
     }
 
     void updateUniformBuffer(uint32_t currentImage) {
@@ -442,8 +1283,6 @@ protected:
 
         // Update perspective projection
         const float FOVy = glm::radians(45.0f);
-        const float nearPlane = 0.1f;
-        const float farPlane = 500.0f;
         glm::mat4 Prj = glm::perspective(FOVy, Ar, nearPlane, farPlane);
         Prj[1][1] *= -1;
 
@@ -492,12 +1331,48 @@ protected:
             }
         }
 
+        // Toggle circular/Keplerian orbits - K
+        if (glfwGetKey(window, GLFW_KEY_K)) {
+            if (!debounce) {
+                debounce = true;
+                curDebounce = GLFW_KEY_K;
+
+                ephemeris.keplerian = !ephemeris.keplerian;
+                std::cout << std::endl << (ephemeris.keplerian ? "Keplerian" : "Circular") << " orbits" << std::endl;
+            }
+        }
+        else {
+            if ((curDebounce == GLFW_KEY_K) && debounce) {
+                debounce = false;
+                curDebounce = 0;
+            }
+        }
+
+        // Toggle N-body gravity - G
+        if (glfwGetKey(window, GLFW_KEY_G)) {
+            if (!debounce) {
+                debounce = true;
+                curDebounce = GLFW_KEY_G;
+
+                nbodyMode = !nbodyMode;
+                nbody.clear();
+                scene.setLocal(sunOrbitNode, glm::mat4(1.0f));
+                std::cout << std::endl << (nbodyMode ? "N-body gravity" : "Fixed orbits") << std::endl;
+            }
+        }
+        else {
+            if ((curDebounce == GLFW_KEY_G) && debounce) {
+                debounce = false;
+                curDebounce = 0;
+            }
+        }
+
         // Handle speed changes
         if (glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS) {  // 'M' key (More speed)
-            speedMultiplier = glm::min(speedMultiplier + speedStep, maxSpeed);
+            speedMultiplier = glm::min(speedMultiplier * (1.0f + speedStep), maxSpeed);
         }
         else if (glfwGetKey(window, GLFW_KEY_N) == GLFW_PRESS) {  // 'N' key (Nless speed)
-            speedMultiplier = glm::max(speedMultiplier - speedStep, minSpeed);
+            speedMultiplier = glm::max(speedMultiplier / (1.0f + speedStep), minSpeed);
         }
 
         // Close game with ESC
@@ -505,119 +1380,239 @@ protected:
             glfwSetWindowShouldClose(window, GL_TRUE);
         }
 
-        // Update accumulated time
-        accumulatedTime += deltaT * speedMultiplier;
+        // Update accumulated time and advance every orbital phase to it
+        accumulatedTime += (double)deltaT * speedMultiplier;
+        ephemeris.advanceTo(accumulatedTime);
+
+        // Compute the positions and rotations of all planets and the moon in one pass,
+        // positions are interpolated from the keyframes once they are available
+        if (ephemerisCache.isReady()) {
+            ephemerisCache.interpolate(ephemeris, accumulatedTime);
+            ephemeris.computeRotations();
+        }
+        else {
+            ephemeris.computeTransforms();
+        }
+
+        // In N-body mode the sun and the bodies orbiting it are placed by the gravity
+        // simulation, satellites keep their orbits around wherever their planet is
+        if (nbodyMode) {
+            if (nbody.count == 0) {
+                seedNBody();
+            }
+            nbody.advanceTo(accumulatedTime);
+            scene.setLocal(sunOrbitNode, glm::translate(glm::mat4(1.0f), nbody.position(0)));
+        }
+        for (int i = 0; i < ephemeris.count; i++) {
+            if (nbodyMode && solarSystem.parent[i] < 0) {
+                scene.setLocal(orbitNode[i], glm::translate(glm::mat4(1.0f), nbody.position(i + 1)));
+            }
+            else {
+                scene.setLocal(orbitNode[i], ephemeris.orbitTransform(i));
+            }
+            scene.setLocal(bodyNode[i], ephemeris.bodyTransform(i));
+        }
+        scene.update();
 
         // Light position (at the sun's position)
-        glm::vec3 lightPos = glm::vec3(0, 0, 0);
+        glm::vec3 lightPos = scene.worldPosition(sunOrbitNode);
+
+        // Camera and light of every object drawn with the split layout
+        if (splitUniforms) {
+            frameUBO.view = View;
+            frameUBO.proj = Prj;
+            frameUBO.lightPos = lightPos;
+            frameDS.map(currentImage, &frameUBO, sizeof(frameUBO), 0);
+        }
 
-        // Update sun uniform buffer
-        glm::mat4 sunWorld = glm::scale(glm::mat4(1.0f), sunScale);
-        sunUBO.model = sunWorld;
-        sunUBO.view = View;
-        sunUBO.proj = Prj;
-        sunUBO.lightPos = lightPos;
-        sunDS.map(currentImage, &sunUBO, sizeof(sunUBO), 0);
+        // Visible set, read when the command buffer of this image is recorded again. Recorded
+        // once, everything stays in the queue, which is still sorted for the current camera so
+        // that drawFrame records the buffer again when the depth order has changed.
+        Frustum frustum(Prj * View);
+        if (recordEveryFrame) {
+            sunVisible = inView(frustum, scene.world[sunNode], sphereRadius);
+            for (int i = 0; i < NUM_PLANETS; i++) {
+                planetVisible[i] = inView(frustum, scene.world[bodyNode[i]], sphereRadius);
+            }
+            moonVisible = inView(frustum, scene.world[bodyNode[moonIndex]], sphereRadius);
+            saturnRingVisible = inView(frustum, scene.world[saturnRingNode], saturnRingRadius);
+        }
+        buildDrawList();
+
+        // Update the instanced spheres: one uniform block and one instance buffer for all bodies
+        if (instancedSpheres) {
+            sphereUBO.view = View;
+            sphereUBO.proj = Prj;
+            sphereUBO.lightPos = lightPos;
+            sphereDS.map(currentImage, &sphereUBO, sizeof(sphereUBO), 0);
+
+            sphereInstanceData[0].model = scene.world[sunNode];
+            for (int i = 0; i < ephemeris.count; i++) {
+                sphereInstanceData[i + 1].model = scene.world[bodyNode[i]];
+            }
 
-        // Update planet uniform buffers
-        for (int i = 0; i < NUM_PLANETS; i++) {
-            // Calculate planet position
-            float angle = accumulatedTime * planetProps[i].revolutionSpeed;
-            glm::vec3 position(
-                cos(angle) * planetProps[i].orbitRadius,
-                sin(planetProps[i].eclipticInclination) * planetProps[i].orbitRadius * sin(angle),
-                sin(angle) * planetProps[i].orbitRadius * cos(planetProps[i].eclipticInclination)
-            );
-
-            // Calculate planet rotation
-            glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), planetProps[i].axialTilt, glm::vec3(0, 0, 1)) *
-                glm::rotate(glm::mat4(1.0f), accumulatedTime * planetProps[i].rotationSpeed, glm::vec3(0, 1, 0));
-
-            // Create world matrix
-            glm::mat4 World = glm::translate(glm::mat4(1.0f), position) *
-                rotation *
-                glm::scale(glm::mat4(1.0f), planetProps[i].scale);
-
-            // Update uniform buffer
-            planetUBO[i].model = World;
-            planetUBO[i].view = View;
-            planetUBO[i].proj = Prj;
-            planetUBO[i].lightPos = lightPos;
-            planetDS[i].map(currentImage, &planetUBO[i], sizeof(planetUBO[i]), 0);
-        }
-
-        // Update moon uniform buffer
-        int earthIndex = 2; // Assuming Earth is the third planet (index 2) in our array
-        float earthAngle = accumulatedTime * planetProps[earthIndex].revolutionSpeed;
-        glm::vec3 earthPosition(
-            cos(earthAngle) * planetProps[earthIndex].orbitRadius,
-            sin(planetProps[earthIndex].eclipticInclination) * planetProps[earthIndex].orbitRadius * sin(earthAngle),
-            sin(earthAngle) * planetProps[earthIndex].orbitRadius * cos(planetProps[earthIndex].eclipticInclination)
-        );
-
-        float moonAngle = accumulatedTime * moonProps.revolutionSpeed;
-        glm::vec3 moonRelativePosition(
-            cos(moonAngle) * moonProps.orbitRadius,
-            sin(moonAngle) * moonProps.orbitRadius,
-            0
-        );
-
-        glm::vec3 moonPosition = earthPosition + moonRelativePosition;
-
-        glm::mat4 moonRotation = glm::rotate(glm::mat4(1.0f), accumulatedTime * moonProps.rotationSpeed, glm::vec3(0, 1, 0));
-
-        glm::mat4 moonWorld = glm::translate(glm::mat4(1.0f), moonPosition) *
-            moonRotation *
-            glm::scale(glm::mat4(1.0f), moonProps.scale);
-
-        moonUBO.model = moonWorld;
-        moonUBO.view = View;
-        moonUBO.proj = Prj;
-        moonUBO.lightPos = lightPos;
-        moonDS.map(currentImage, &moonUBO, sizeof(moonUBO), 0);
+            // Only the visible instances are uploaded and drawn when recording every frame,
+            // unless the GPU culls them
+            const std::vector<SphereInstance>* instances = &sphereInstanceData;
+            if (recordEveryFrame && !gpuCulling) {
+                visibleSphereInstances.clear();
+                for (const SphereInstance& instance : sphereInstanceData) {
+                    if (inView(frustum, instance.model, sphereRadius)) {
+                        visibleSphereInstances.push_back(instance);
+                    }
+                }
+                instances = &visibleSphereInstances;
+            }
+            if (!instances->empty()) {
+                sphereInstances.map(currentImage, instances->data(),
+                    sizeof(SphereInstance) * instances->size());
+            }
+        }
+        else {
+            updateBodyUniforms(currentImage, Prj, lightPos);
+        }
 
         // Update Saturn Ring uniform buffer
-        int saturnIndex = 5; // Assuming Saturn is the sixth planet (index 5) in our array
-        float saturnAngle = accumulatedTime * planetProps[saturnIndex].revolutionSpeed;
-        glm::vec3 saturnPosition(
-            cos(saturnAngle) * planetProps[saturnIndex].orbitRadius,
-            sin(planetProps[saturnIndex].eclipticInclination) * planetProps[saturnIndex].orbitRadius * sin(saturnAngle),
-            sin(saturnAngle) * planetProps[saturnIndex].orbitRadius * cos(planetProps[saturnIndex].eclipticInclination)
-        );
-
-        glm::mat4 ringRotation = glm::rotate(glm::mat4(1.0f), 59.6f, glm::vec3(0, 1, 0));
-
-        glm::mat4 saturnRingWorld = glm::translate(glm::mat4(1.0f), saturnPosition) *
-            ringRotation *
-            glm::scale(glm::mat4(1.0f), glm::vec3(0.18f));
-
-        saturnRingUBO.model = saturnRingWorld;
-        saturnRingUBO.view = View;
-        saturnRingUBO.proj = Prj;
-        saturnRingUBO.lightPos = lightPos;
-        saturnRingDS.map(currentImage, &saturnRingUBO, sizeof(saturnRingUBO), 0);
+        mapObjectUniforms(currentImage, saturnRingDS, saturnRingUBO, scene.world[saturnRingNode], false, Prj, lightPos);
 
         // Update skybox uniform buffer
         glm::mat4 skyboxModel = glm::scale(glm::mat4(1.0f), glm::vec3(farPlane / 2.0f));
         skyboxUBO.mvpMat = Prj * glm::mat4(glm::mat3(View)) * skyboxModel; // Remove translation and scale
         skyboxDS.map(currentImage, &skyboxUBO, sizeof(skyboxUBO), 0);
 
+        // Only the camera and the clock reach the GPU belts each frame
+        if (gpuBelts) {
+            asteroidUBO.viewProj = Prj * View;
+            asteroidUBO.lightPos = lightPos;
+            asteroidUBO.time = splitHigh(accumulatedTime);
+            asteroidUBO.timeLow = (float)(accumulatedTime - asteroidUBO.time);
+            asteroidComputeDS.map(currentImage, &asteroidUBO, sizeof(asteroidUBO), 2);
+            asteroidDS.map(currentImage, &asteroidUBO, sizeof(asteroidUBO), 0);
+        }
+
+        // Culling tests against this frame's frustum, and against the depth pyramid with the
+        // camera of the frame that left its depth in the buffer
+        if (gpuCulling) {
+            mapCullUniforms(currentImage, sphereCull, frustum);
+            if (gpuBelts) {
+                mapCullUniforms(currentImage, asteroidCull, frustum);
+            }
+            lastViewProj = Prj * View;
+            culledFrames++;
+        }
+
         // Display speed indicator (you can replace this with on-screen rendering later)
-        static float lastPrintTime = 0.0f;
+        static double lastPrintTime = 0.0;
         if (accumulatedTime - lastPrintTime > 0.1f) {  // Update every tenth second
-            int speedPercentage = static_cast<int>((speedMultiplier / maxSpeed) * 100);
-            std::cout << "\rSpeed: " << speedPercentage << "% " << std::string(speedPercentage / 2, '|') << std::flush;
+            // Logarithmic bar, the time warp spans several orders of magnitude
+            int speedPercentage = static_cast<int>(std::log(speedMultiplier / minSpeed) / std::log(maxSpeed / minSpeed) * 100);
+            std::cout << "\rSpeed: x" << speedMultiplier << " " << std::string(speedPercentage / 2, '|');
+            if (recordEveryFrame) {
+                std::cout << " Recording: " << commandRecordMsAverage << " ms";
+            }
+            std::cout << "        " << std::flush;
             lastPrintTime = accumulatedTime;
         }
     }
 };
 
+// Measures the Keplerian propagation of a synthetic catalog of bodies, one frame at a time
+void runKeplerBenchmark(int bodies) {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    EphemerisBatch batch;
+    for (int i = 0; i < bodies; i++) {
+        float a = 10.0f + 90.0f * unit(rng);
+        batch.addBody(a, 1.0f / std::pow(a / 20.0f, 1.5f), 0.0f,
+            glm::radians(30.0f) * unit(rng), 0.0f, 1.0f,
+            0.9f * unit(rng) * unit(rng),
+            glm::radians(360.0f) * unit(rng), glm::radians(360.0f) * unit(rng));
+    }
+    batch.keplerian = true;
+
+    const int frames = 200;
+    const double frameTime = 1.0 / 60.0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int f = 1; f <= frames; f++) {
+        batch.advanceTo(f * frameTime);
+        batch.computePositions();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << "Kepler benchmark: " << bodies << " bodies, " << frames << " frames, "
+        << seconds * 1000.0 / frames << " ms/frame, "
+        << (double)bodies * frames / seconds << " bodies/s on one core ("
+        << std::thread::hardware_concurrency() << " available)" << std::endl;
+}
+
+// Writes the trajectories of every planet and moon to a columnar binary file (see TrajectoryExport.hpp)
+int runTrajectoryExport(int argc, char* argv[]) {
+    if (argc < 6) {
+        std::cerr << "Usage: " << argv[0] << " --export <file> <start> <end> <step> [--compress] [--circular]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    TrajectoryExport exporter;
+    for (int a = 6; a < argc; a++) {
+        std::string option = argv[a];
+        if (option == "--compress") {
+            exporter.compress = true;
+        }
+        else if (option == "--circular") {
+            exporter.keplerian = false;
+        }
+        else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    try {
+        SolarSystemEphemeris model;
+        model.loadFile("solarSystemData.json");
+        ThreadPool pool;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        exporter.run(model, argv[2], std::atof(argv[3]), std::atof(argv[4]), std::atof(argv[5]), pool);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        std::cout << "Exported " << model.bodyCount() << " bodies to " << argv[2] << ": "
+            << exporter.bytesWritten << " bytes (" << exporter.rawBytes << " bytes of positions) in "
+            << seconds << " s on " << pool.size() << " threads" << std::endl;
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
 // Main function
-int main() {
+int main(int argc, char* argv[]) {
+    // --bench-kepler [bodies] runs the orbit propagation benchmark without opening a window
+    if (argc > 1 && std::string(argv[1]) == "--bench-kepler") {
+        runKeplerBenchmark(argc > 2 ? std::atoi(argv[2]) : 100000);
+        return EXIT_SUCCESS;
+    }
+
+    // --export <file> <start> <end> <step> streams the trajectories without opening a window
+    if (argc > 1 && std::string(argv[1]) == "--export") {
+        return runTrajectoryExport(argc, argv);
+    }
+
     SolarSimulator app;
 
     try {
-        app.run();
+        // --bench-vertex [vertices] compares device local and host visible geometry, then exits
+        if (argc > 1 && std::string(argv[1]) == "--bench-vertex") {
+            app.benchmarkVertices(argc > 2 ? std::atoi(argv[2]) : 3000000);
+        }
+        else {
+            app.run();
+        }
     }
     catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
@@ -0,0 +1,177 @@
+// SolarSystemEphemeris.hpp
+// The orbital model of solarSystemData.json without any window or Vulkan dependency.
+// Loads the planets and moons into an EphemerisBatch and answers batched position
+// queries for many bodies at many times, e.g. for tools and services that never
+// start the renderer. Only glm and the bundled json.hpp are needed.
+//
+// Bodies are indexed as in the batch: the planets ordered by distance from the sun,
+// then the moons, each one after the body it orbits.
+
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <json.hpp>
+#include <glm/glm.hpp>
+#include "Ephemeris.hpp"
+#include "ThreadPool.hpp"
+
+class SolarSystemEphemeris {
+public:
+    // Timestamps handed to one thread at a time by positions()
+    static const int QUERY_GRAIN = 64;
+
+    EphemerisBatch batch;
+    std::vector<std::string> names;
+    std::vector<int> parent;    // Index of the body orbited, -1 for the sun
+
+    void loadFile(const std::string& path) {
+        std::ifstream file(path);
+        if (!file) {
+            throw std::runtime_error("Failed to open " + path);
+        }
+        nlohmann::json data;
+        file >> data;
+        load(data);
+    }
+
+    // Planets are the entries with a positive "distance_from_sun", moons the entries
+    // with a "parent"; other entries (the sun, belts, settings) are ignored
+    void load(const nlohmann::json& data) {
+        batch = EphemerisBatch();
+        names.clear();
+        parent.clear();
+
+        std::vector<std::string> planets, moons;
+        for (auto it = data.begin(); it != data.end(); ++it) {
+            if (!it.value().is_object()) {
+                continue;
+            }
+            if (it.value().contains("parent")) {
+                moons.push_back(it.key());
+            }
+            else if (it.value().value("distance_from_sun", 0.0f) > 0.0f) {
+                planets.push_back(it.key());
+            }
+        }
+        std::stable_sort(planets.begin(), planets.end(), [&](const std::string& a, const std::string& b) {
+            return data[a]["distance_from_sun"].get<float>() < data[b]["distance_from_sun"].get<float>();
+        });
+
+        for (const std::string& name : planets) {
+            const auto& planetData = data[name];
+            batch.addBody(planetData["distance_from_sun"].get<float>(),
+                1.0f / planetData["revolution_period"].get<float>(),
+                1.0f / planetData["rotation_period"].get<float>(),
+                glm::radians(planetData["ecliptic_inclination"].get<float>()),
+                glm::radians(planetData["axial_tilt"].get<float>()),
+                planetData["radius"].get<float>(),
+                planetData.value("eccentricity", 0.0f),
+                glm::radians(planetData.value("argument_of_periapsis", 0.0f)),
+                glm::radians(planetData.value("ascending_node", 0.0f)));
+            names.push_back(name);
+            parent.push_back(-1);
+        }
+
+        // Moons orbit their planet in the xy-plane, i.e. at 90 degrees from the ecliptic, unless
+        // told otherwise. A moon of a moon needs its parent added first, so keep passing over
+        // the list until no more can be placed.
+        std::vector<std::string> pending = moons;
+        while (!pending.empty()) {
+            std::vector<std::string> waiting;
+            for (const std::string& name : pending) {
+                const auto& moonData = data[name];
+                int p = findBody(moonData["parent"].get<std::string>());
+                if (p < 0) {
+                    waiting.push_back(name);
+                    continue;
+                }
+                batch.addBody(moonData["distance_from_planet"].get<float>(),
+                    1.0f / moonData["revolution_period"].get<float>(),
+                    1.0f / moonData["rotation_period"].get<float>(),
+                    glm::radians(moonData.value("ecliptic_inclination", 90.0f)),
+                    glm::radians(moonData.value("axial_tilt", 0.0f)),
+                    moonData["radius"].get<float>(),
+                    moonData.value("eccentricity", 0.0f),
+                    glm::radians(moonData.value("argument_of_periapsis", 0.0f)),
+                    glm::radians(moonData.value("ascending_node", 0.0f)));
+                names.push_back(name);
+                parent.push_back(p);
+            }
+            if (waiting.size() == pending.size()) {
+                throw std::runtime_error("Unknown parent of moon: " + waiting[0]);
+            }
+            pending = waiting;
+        }
+    }
+
+    int bodyCount() const {
+        return batch.count;
+    }
+
+    int bodyIndex(const std::string& name) const {
+        int i = findBody(name);
+        if (i < 0) {
+            throw std::runtime_error("Unknown body: " + name);
+        }
+        return i;
+    }
+
+    // Heliocentric positions of the given bodies at every timestamp. 'out' must hold
+    // timeCount * bodyCount * 3 floats and is filled time-major, i.e. body n at time m
+    // is at out[(m * bodyCount + n) * 3]. Timestamps are spread over the pool if given.
+    void positions(const int* bodies, size_t bodyCount, const double* times, size_t timeCount,
+        float* out, bool keplerian = false, ThreadPool* pool = nullptr) const {
+        for (size_t n = 0; n < bodyCount; n++) {
+            if (bodies[n] < 0 || bodies[n] >= batch.count) {
+                throw std::runtime_error("Body index out of range");
+            }
+        }
+
+        auto range = [&](int begin, int end) {
+            EphemerisBatch b = batch;
+            b.keplerian = keplerian;
+            std::vector<glm::vec3> absolute(batch.count);
+            for (int m = begin; m < end; m++) {
+                b.setTime(times[m]);
+                b.computePositions();
+                for (int i = 0; i < b.count; i++) {
+                    absolute[i] = b.position(i) + (parent[i] >= 0 ? absolute[parent[i]] : glm::vec3(0.0f));
+                }
+                float* row = out + (size_t)m * bodyCount * 3;
+                for (size_t n = 0; n < bodyCount; n++) {
+                    const glm::vec3& p = absolute[bodies[n]];
+                    row[n * 3 + 0] = p.x;
+                    row[n * 3 + 1] = p.y;
+                    row[n * 3 + 2] = p.z;
+                }
+            }
+        };
+
+        if (pool) {
+            pool->parallelFor((int)timeCount, QUERY_GRAIN, range);
+        }
+        else {
+            range(0, (int)timeCount);
+        }
+    }
+
+    // All bodies at every timestamp, out holds timeCount * bodyCount() * 3 floats
+    void positions(const double* times, size_t timeCount, float* out,
+        bool keplerian = false, ThreadPool* pool = nullptr) const {
+        std::vector<int> all(batch.count);
+        for (int i = 0; i < batch.count; i++) {
+            all[i] = i;
+        }
+        positions(all.data(), all.size(), times, timeCount, out, keplerian, pool);
+    }
+
+private:
+    int findBody(const std::string& name) const {
+        auto it = std::find(names.begin(), names.end(), name);
+        return it == names.end() ? -1 : (int)(it - names.begin());
+    }
+};
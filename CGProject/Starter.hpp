@@ -7,6 +7,7 @@
 #include <cstring>
 #include <optional>
 #include <set>
+#include <map>
 #include <cstdint>
 #include <algorithm>
 #include <fstream>
@@ -42,6 +43,10 @@
 #define SINFL_IMPLEMENTATION
 #include <sinfl.h>
 
+#include "ThreadPool.hpp"
+#include "MemoryAllocator.hpp"
+#include "MeshOptimizer.hpp"
+
 
 
 const int MAX_FRAMES_IN_FLIGHT = 2;
@@ -57,6 +62,7 @@ std::vector<const char*> deviceExtensions = {
 struct QueueFamilyIndices {
 	std::optional<uint32_t> graphicsFamily;
 	std::optional<uint32_t> presentFamily;
+	std::optional<uint32_t> transferFamily;		// Without graphics, when the device has one
 
 	bool isComplete() {
 		return graphicsFamily.has_value() &&
@@ -197,7 +203,15 @@ struct VertexDescriptor {
 	std::vector<VertexBindingDescriptorElement> Bindings;
 	std::vector<VertexDescriptorElement> Layout;
 
+	// Compact layout of binding 0 on the GPU, encoded by pack from the float vertices the
+	// loaders fill: half float positions, octahedral snorm16 normals, unorm16 UVs
+	bool packed = false;
+	uint32_t packedStride = 0;
+	std::vector<VertexDescriptorElement> PackedLayout;
+
 	void init(BaseProject* bp, std::vector<VertexBindingDescriptorElement> B, std::vector<VertexDescriptorElement> E);
+	void usePackedLayout();
+	void pack(const void* vertices, size_t count, uint32_t stride, std::vector<uint8_t>& out) const;
 	void cleanup();
 
 	std::vector<VkVertexInputBindingDescription> getBindingDescription();
@@ -207,39 +221,75 @@ struct VertexDescriptor {
 
 enum ModelType { OBJ, GLTF, MGCG };
 
+// Buffers of a loaded mesh, shared by every Model loaded from the same file, as the same
+// model type and with the same vertex layout. No host copy of the geometry is kept, so host
+// memory grows with the number of distinct meshes, not with the number of models.
+struct MeshCacheEntry {
+	VkBuffer vertexBuffer;
+	MemoryAllocation vertexBufferMemory;
+	VkBuffer indexBuffer;
+	MemoryAllocation indexBufferMemory;
+	VkIndexType indexType;
+	uint32_t vertexCount, indexCount;
+	float radius;
+	int refCount;
+};
+
 template <class Vert>
 class Model {
 	BaseProject* BP;
 
 	VkBuffer vertexBuffer;
-	VkDeviceMemory vertexBufferMemory;
+	MemoryAllocation vertexBufferMemory;
 	VkBuffer indexBuffer;
-	VkDeviceMemory indexBufferMemory;
+	MemoryAllocation indexBufferMemory;
+	VkIndexType indexType = VK_INDEX_TYPE_UINT32;	// 16 bits when every vertex can be addressed
 	VertexDescriptor* VD;
 
+	// Cache entry holding the buffers, null for meshes built with initMesh
+	std::string meshKey;
+	MeshCacheEntry* mesh = nullptr;
+	std::string cacheKey(const std::string& file, ModelType MT);
+	void createGeometryBuffer(const void* src, VkDeviceSize size, VkBufferUsageFlags usage,
+		VkBuffer& buffer, MemoryAllocation& memory);
+
 public:
 	std::vector<Vert> vertices{};
 	std::vector<uint32_t> indices{};
+	// Geometry is uploaded to device local memory. Set before init for a mesh whose
+	// vertices change, to keep its buffers host visible for updateVertexBuffer.
+	bool hostVisible = false;
+	// Clear before init to free vertices and indices as soon as they are staged for upload.
+	// Models sharing a cached mesh never get them; the counts and the radius below are
+	// always valid.
+	bool keepGeometry = true;
+	uint32_t vertexCount = 0;
+	uint32_t indexCount = 0;
+	float radius = 0.0f;		// Largest distance of a vertex from the mesh origin
 	void loadModelOBJ(std::string file);
 	void loadModelGLTF(std::string file, bool encoded);
 	void createIndexBuffer();
 	void createVertexBuffer();
+	void updateVertexBuffer();
+	void releaseGeometry();
 
 	void init(BaseProject* bp, VertexDescriptor* VD, std::string file, ModelType MT);
 	void initMesh(BaseProject* bp, VertexDescriptor* VD);
 	void cleanup();
 	void bind(VkCommandBuffer commandBuffer);
+	// Vertex buffer, the same for models sharing a cache entry, so one bind serves them all
+	VkBuffer meshBuffer() const { return vertexBuffer; }
 };
 
 struct Texture {
 	BaseProject* BP;
 	uint32_t mipLevels;
 	VkImage textureImage;
-	VkDeviceMemory textureImageMemory;
+	MemoryAllocation textureImageMemory;
 	VkImageView textureImageView;
 	VkSampler textureSampler;
 	int imgs;
-	static const int maxImgs = 6;
+	VkImageViewType viewType;
 
 	void createTextureImage(const char* const files[], VkFormat Fmt);
 	void createTextureImageView(VkFormat Fmt);
@@ -255,7 +305,21 @@ struct Texture {
 
 	void init(BaseProject* bp, const char* file, VkFormat Fmt, bool initSampler);
 	void initCubic(BaseProject* bp, const char* files[6]);
+	void initArray(BaseProject* bp, const std::vector<std::string>& files);
+	void cleanup();
+};
+
+// Per-instance vertex data rewritten every frame, one host visible buffer per swapchain image
+struct InstanceBuffer {
+	BaseProject* BP;
+	VkDeviceSize size;
+	std::vector<VkBuffer> buffers;
+	std::vector<MemoryAllocation> buffersMemory;
+
+	void init(BaseProject* bp, VkDeviceSize size);
 	void cleanup();
+	void map(int currentImage, const void* src, VkDeviceSize size);
+	void bind(VkCommandBuffer commandBuffer, uint32_t binding, int currentImage);
 };
 
 struct DescriptorSetLayoutBinding {
@@ -302,29 +366,177 @@ struct Pipeline {
 	void cleanup();
 };
 
-enum DescriptorSetElementType { UNIFORM, TEXTURE };
+struct ComputePipeline {
+	BaseProject* BP;
+	VkPipeline computePipeline;
+	VkPipelineLayout pipelineLayout;
+
+	VkShaderModule compShaderModule;
+	std::vector<DescriptorSetLayout*> D;
+
+	void init(BaseProject* bp, const std::string& CompShader,
+		std::vector<DescriptorSetLayout*> D);
+	void create();
+	void destroy();
+	void bind(VkCommandBuffer commandBuffer);
+	void dispatch(VkCommandBuffer commandBuffer, uint32_t items, uint32_t groupSize);
+
+	VkShaderModule createShaderModule(const std::vector<char>& code);
+	void cleanup();
+};
+
+// Device local buffer written and read by shaders, optionally also usable as a vertex buffer
+struct StorageBuffer {
+	BaseProject* BP;
+	VkBuffer buffer;
+	MemoryAllocation bufferMemory;
+	VkDeviceSize size;
+
+	void init(BaseProject* bp, VkDeviceSize size, VkBufferUsageFlags extraUsage,
+		const void* initialData = nullptr);
+	void cleanup();
+	void bindAsVertexBuffer(VkCommandBuffer commandBuffer, uint32_t binding);
+	void barrier(VkCommandBuffer commandBuffer,
+		VkPipelineStageFlags srcStage, VkAccessFlags srcAccess,
+		VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
+};
+
+// One persistently mapped buffer holding the uniform blocks of every object for every swapchain
+// image. Each object suballocates an aligned slice once, and finds it in the region of the
+// current image through a dynamic uniform buffer offset.
+struct UniformRingBuffer {
+	BaseProject* BP;
+	VkBuffer buffer;
+	MemoryAllocation bufferMemory;
+	uint8_t* mapped;
+	VkDeviceSize frameSize;		// Bytes reserved for each swapchain image
+	VkDeviceSize alignment;
+	VkDeviceSize used;			// Bytes suballocated in every frame region
+
+	void init(BaseProject* bp, VkDeviceSize frameSize, int frames);
+	VkDeviceSize allocate(VkDeviceSize size);
+	void write(int currentImage, VkDeviceSize offset, const void* src, VkDeviceSize size);
+	uint32_t dynamicOffset(int currentImage, VkDeviceSize offset) const;
+	void cleanup();
+};
+
+// Farthest depth of the last rendered frame over ever larger screen regions, one mip level
+// per halving of the resolution, for occlusion culling. The chain is rebuilt from the depth
+// buffer at the start of every frame, before the culling passes that sample it.
+struct DepthPyramid {
+	static const uint32_t MAX_LEVELS = 16;
+
+	BaseProject* BP;
+	VkImage image;
+	MemoryAllocation imageMemory;
+	uint32_t width, height;		// Level 0, half the resolution of the depth buffer
+	uint32_t levels;
+	std::vector<VkImageView> levelViews;
+	Texture texture;			// Every level, for TEXTURE elements of the culling sets
+
+	// Level 0 reads the depth buffer, with the multisampled variant if it has several samples
+	DescriptorSetLayout DSL;
+	ComputePipeline reduce, reduceMultisampled;
+	std::vector<VkDescriptorSet> levelSets;
+
+	void init(BaseProject* bp, const std::string& ReduceShader,
+		const std::string& MultisampledShader);
+	void create();
+	void build(VkCommandBuffer commandBuffer);
+	void cleanup();
+	void destroy();
+};
+
+// Batches the commands that upload assets, so loading never waits for the GPU. Copies are
+// recorded on the transfer queue when the device has a separate family for it, everything
+// else on the graphics queue after them, and ownership moves between the two. A batch is
+// submitted by flush, before the next frame, and its staging space is recycled once its
+// fence signals. Batches are numbered, to ask whether the assets of one are on the GPU.
+// Staging space comes from one persistently mapped ring buffer with a fixed budget: a batch
+// owns the part of the ring written since the previous one, and when the ring is full the
+// oldest batches are waited for. Only an upload larger than the whole ring gets a staging
+// buffer of its own.
+struct UploadQueue {
+	struct Batch {
+		uint64_t id = 0;
+		VkCommandBuffer transfer = VK_NULL_HANDLE;
+		VkCommandBuffer graphics = VK_NULL_HANDLE;
+		VkSemaphore copied = VK_NULL_HANDLE;
+		VkFence done = VK_NULL_HANDLE;
+		VkDeviceSize ringEnd = 0;	// Ring position after the last staging region of the batch
+		std::vector<std::pair<VkBuffer, MemoryAllocation>> staging;
+	};
+
+	// Where to write the data of one upload, and where to copy it from
+	struct StagingRegion {
+		VkBuffer buffer;
+		VkDeviceSize offset;
+		void* data;
+	};
+
+	BaseProject* BP;
+	bool dedicated;				// Copies run on a transfer queue family of their own
+	uint32_t transferFamily, graphicsFamily;
+	VkCommandPool transferPool, graphicsPool;
+	Batch open;
+	std::vector<Batch> inFlight;		// Oldest first
+
+	VkBuffer ringBuffer;
+	MemoryAllocation ringMemory;
+	VkDeviceSize ringSize, ringAlignment;
+	VkDeviceSize ringHead, ringTail;	// Running totals, the ring offset is their remainder
+
+	void init(BaseProject* bp, VkDeviceSize stagingBudget = 32 * 1024 * 1024);
+	StagingRegion stage(VkDeviceSize size);
+	VkCommandBuffer transferCommands();
+	VkCommandBuffer graphicsCommands();
+	void handOverBuffer(VkBuffer buffer, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
+	void handOverImage(VkImage image, VkImageLayout layout, uint32_t mipLevels, int layerCount);
+	void retire(VkBuffer buffer, MemoryAllocation& memory);
+	uint64_t pending() const { return open.id; }
+	uint64_t flush();
+	void collect();
+	bool isComplete(uint64_t id);
+	void wait(uint64_t id);
+	void cleanup();
+
+private:
+	VkCommandBuffer begin(VkCommandPool pool, VkCommandBuffer& commandBuffer);
+	void release(Batch& batch);
+	void waitOldest();
+};
+
+enum DescriptorSetElementType { UNIFORM, TEXTURE, STORAGE, UNIFORM_DYNAMIC };
 
 struct DescriptorSetElement {
 	int binding;
 	DescriptorSetElementType type;
 	int size;
 	Texture* tex;
+	StorageBuffer* buf = nullptr;
+	InstanceBuffer* inst = nullptr;		// STORAGE element bound to the buffer of each image
 };
 
 struct DescriptorSet {
 	BaseProject* BP;
 
 	std::vector<std::vector<VkBuffer>> uniformBuffers;
-	std::vector<std::vector<VkDeviceMemory>> uniformBuffersMemory;
+	std::vector<std::vector<MemoryAllocation>> uniformBuffersMemory;
 	std::vector<VkDescriptorSet> descriptorSets;
 
 	std::vector<bool> toFree;
 
+	// Slices of the uniform ring used by UNIFORM_DYNAMIC elements, and those elements by binding
+	std::vector<VkDeviceSize> ringOffsets;
+	std::vector<int> dynamicElements;
+
 	void init(BaseProject* bp, DescriptorSetLayout* L,
 		std::vector<DescriptorSetElement> E);
 	void cleanup();
 	void bind(VkCommandBuffer commandBuffer, Pipeline& P, int setId, int currentImage);
+	void bind(VkCommandBuffer commandBuffer, ComputePipeline& P, int setId, int currentImage);
 	void map(int currentImage, void* src, int size, int slot);
+	std::vector<uint32_t> dynamicOffsets(int currentImage);
 };
 
 
@@ -334,6 +546,12 @@ class BaseProject {
 	template <class Vert> friend class Model;
 	friend class Texture;
 	friend class Pipeline;
+	friend class ComputePipeline;
+	friend class StorageBuffer;
+	friend class InstanceBuffer;
+	friend class UniformRingBuffer;
+	friend class DepthPyramid;
+	friend class UploadQueue;
 	friend class DescriptorSetLayout;
 	friend class DescriptorSet;
 public:
@@ -357,6 +575,21 @@ protected:
 	int uniformBlocksInPool;
 	int texturesInPool;
 	int setsInPool;
+	int storageBuffersInPool = 0;
+	int dynamicUniformBlocksInPool = 0;
+	int storageImagesInPool = 0;
+	// Keeps the depth buffer after the render pass and lets shaders sample it (DepthPyramid)
+	bool sampledDepth = false;
+
+	// Every buffer and image is a range of a few large memory blocks
+	MemoryAllocator memoryAllocator;
+
+	// Staging copies, layout transitions and mipmaps of assets, submitted in batches
+	UploadQueue uploads;
+
+	// Bytes of uniform data per swapchain image in the uniform ring
+	VkDeviceSize uniformRingFrameSize = 64 * 1024;
+	UniformRingBuffer uniformRing;
 
 	GLFWwindow* window;
 	VkInstance instance;
@@ -365,10 +598,28 @@ protected:
 	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
 	VkDevice device;
 	VkQueue graphicsQueue;
+	VkQueue transferQueue;		// graphicsQueue when there is no separate transfer family
 	VkQueue presentQueue;
 	VkCommandPool commandPool;
 	std::vector<VkCommandBuffer> commandBuffers;
 
+	// When set, the command buffer of every swapchain image is recorded again each frame,
+	// after updateUniformBuffer, from a transient pool of its own that is reset as a whole.
+	// populateCommandBuffer can then change what is drawn from one frame to the next.
+	bool recordEveryFrame = false;
+	std::vector<VkCommandPool> frameCommandPools;
+	// CPU time of the last recording and its moving average, in milliseconds
+	double commandRecordMs = 0.0;
+	double commandRecordMsAverage = 0.0;
+
+	// Parallel recording, with recordEveryFrame: when a pool is given, the draw list is cut
+	// into one slice per worker, and each slice is recorded into a secondary command buffer
+	// allocated from a pool of its own, [image][slice]. The primary buffer executes them in
+	// order inside the render pass, and populateCommandBuffer is not called.
+	ThreadPool* recordingPool = nullptr;
+	std::vector<std::vector<VkCommandPool>> secondaryCommandPools;
+	std::vector<std::vector<VkCommandBuffer>> secondaryCommandBuffers;
+
 	VkSwapchainKHR swapChain;
 	std::vector<VkImage> swapChainImages;
 	VkFormat swapChainImageFormat;
@@ -379,15 +630,18 @@ protected:
 
 	VkDescriptorPool descriptorPool;
 
+	// Meshes loaded by Model::init, see MeshCacheEntry
+	std::map<std::string, MeshCacheEntry> meshCache;
+
 	VkDebugUtilsMessengerEXT debugMessenger;
 
 	VkImage depthImage;
-	VkDeviceMemory depthImageMemory;
+	MemoryAllocation depthImageMemory;
 	VkImageView depthImageView;
 
 	VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
 	VkImage colorImage;
-	VkDeviceMemory colorImageMemory;
+	MemoryAllocation colorImageMemory;
 	VkImageView colorImageView;
 
 	std::vector<VkFramebuffer> swapChainFramebuffers;
@@ -431,20 +685,27 @@ protected:
 		createSurface();
 		pickPhysicalDevice();
 		createLogicalDevice();
+		memoryAllocator.init(physicalDevice, device);
 		createSwapChain();
 		createImageViews();
 		createRenderPass();
 		createCommandPool();
+		uploads.init(this);
 		createColorResources();
 		createDepthResources();
 		createFramebuffers();
 		createDescriptorPool();
+		uniformRing.init(this, uniformRingFrameSize, static_cast<int>(swapChainImages.size()));
 
 		localInit();
 		pipelinesAndDescriptorSetsInit();
 
 		createCommandBuffers();
 		createSyncObjects();
+		uploads.flush();
+
+		std::cout << "Device memory: " << memoryAllocator.allocationCount() << " allocations in "
+			<< memoryAllocator.blockCount() << " blocks\n";
 	}
 
 	void createInstance() {
@@ -724,7 +985,9 @@ protected:
 
 		int i = 0;
 		for (const auto& queueFamily : queueFamilies) {
-			if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+			// Compute work is recorded in the same command buffers as the draws
+			if ((queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) &&
+				(queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT)) {
 				indices.graphicsFamily = i;
 			}
 
@@ -741,6 +1004,15 @@ protected:
 			i++;
 		}
 
+		// Copy engines show up as families without graphics, preferably without compute too
+		for (uint32_t f = 0; f < queueFamilyCount; f++) {
+			VkQueueFlags flags = queueFamilies[f].queueFlags;
+			if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT) &&
+				(!indices.transferFamily.has_value() || !(flags & VK_QUEUE_COMPUTE_BIT))) {
+				indices.transferFamily = f;
+			}
+		}
+
 		return indices;
 	}
 
@@ -817,6 +1089,9 @@ protected:
 		std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
 		std::set<uint32_t> uniqueQueueFamilies =
 		{ indices.graphicsFamily.value(), indices.presentFamily.value() };
+		if (indices.transferFamily.has_value()) {
+			uniqueQueueFamilies.insert(indices.transferFamily.value());
+		}
 
 		float queuePriority = 1.0f;
 		for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -857,6 +1132,10 @@ protected:
 
 		vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
 		vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+		transferQueue = graphicsQueue;
+		if (indices.transferFamily.has_value()) {
+			vkGetDeviceQueue(device, indices.transferFamily.value(), 0, &transferQueue);
+		}
 	}
 
 	void createSwapChain() {
@@ -1019,7 +1298,8 @@ protected:
 		depthAttachment.format = findDepthFormat();
 		depthAttachment.samples = msaaSamples;
 		depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-		depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		depthAttachment.storeOp = sampledDepth ? VK_ATTACHMENT_STORE_OP_STORE :
+			VK_ATTACHMENT_STORE_OP_DONT_CARE;
 		depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 		depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 		depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -1118,7 +1398,8 @@ protected:
 		VkCommandPoolCreateInfo poolInfo{};
 		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
 		poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
-		poolInfo.flags = 0; // Optional
+		// Command buffers recorded once can still be recorded again one at a time
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 
 		VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool);
 		if (result != VK_SUCCESS) {
@@ -1145,14 +1426,15 @@ protected:
 
 		createImage(swapChainExtent.width, swapChainExtent.height, 1, 1,
 			msaaSamples, depthFormat, VK_IMAGE_TILING_OPTIMAL,
-			VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, 0,
+			VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+			(sampledDepth ? VK_IMAGE_USAGE_SAMPLED_BIT : 0), 0,
 			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 			depthImage, depthImageMemory);
 		depthImageView = createImageView(depthImage, depthFormat,
 			VK_IMAGE_ASPECT_DEPTH_BIT, 1,
 			VK_IMAGE_VIEW_TYPE_2D, 1);
 
-		transitionImageLayout(depthImage, depthFormat, VK_IMAGE_LAYOUT_UNDEFINED,
+		transitionImageLayout(uploads.graphicsCommands(), depthImage, depthFormat, VK_IMAGE_LAYOUT_UNDEFINED,
 			VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, 1, 1);
 	}
 
@@ -1195,7 +1477,7 @@ protected:
 		VkImageTiling tiling, VkImageUsageFlags usage,
 		VkImageCreateFlags cflags,
 		VkMemoryPropertyFlags properties, VkImage& image,
-		VkDeviceMemory& imageMemory) {
+		MemoryAllocation& imageMemory) {
 		VkImageCreateInfo imageInfo{};
 		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 		imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1221,20 +1503,13 @@ protected:
 		VkMemoryRequirements memRequirements;
 		vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-		VkMemoryAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.allocationSize = memRequirements.size;
-		allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits,
-			properties);
-		if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) !=
-			VK_SUCCESS) {
-			throw std::runtime_error("failed to allocate image memory!");
-		}
-
-		vkBindImageMemory(device, image, imageMemory, 0);
+		imageMemory = memoryAllocator.allocate(memRequirements,
+			findMemoryType(memRequirements.memoryTypeBits, properties),
+			tiling == VK_IMAGE_TILING_LINEAR);
+		vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
 	}
 
-	void generateMipmaps(VkImage image, VkFormat imageFormat,
+	void generateMipmaps(VkCommandBuffer commandBuffer, VkImage image, VkFormat imageFormat,
 		int32_t texWidth, int32_t texHeight,
 		uint32_t mipLevels, int layerCount) {
 		VkFormatProperties formatProperties;
@@ -1246,8 +1521,6 @@ protected:
 			throw std::runtime_error("texture image format does not support linear blitting!");
 		}
 
-		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
 		VkImageMemoryBarrier barrier{};
 		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
 		barrier.image = image;
@@ -1318,15 +1591,11 @@ protected:
 			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
 			0, nullptr, 0, nullptr,
 			1, &barrier);
-
-		endSingleTimeCommands(commandBuffer);
 	}
 
-	void transitionImageLayout(VkImage image, VkFormat format,
+	void transitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkFormat format,
 		VkImageLayout oldLayout, VkImageLayout newLayout,
 		uint32_t mipLevels, int layersCount) {
-		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
 		VkImageMemoryBarrier barrier{};
 		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
 		barrier.oldLayout = oldLayout;
@@ -1382,16 +1651,12 @@ protected:
 		vkCmdPipelineBarrier(commandBuffer,
 			sourceStage, destinationStage, 0,
 			0, nullptr, 0, nullptr, 1, &barrier);
-
-		endSingleTimeCommands(commandBuffer);
 	}
 
-	void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t
-		width, uint32_t height, int layerCount) {
-		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
+	void copyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer buffer, VkImage image, uint32_t
+		width, uint32_t height, int layerCount, VkDeviceSize bufferOffset = 0) {
 		VkBufferImageCopy region{};
-		region.bufferOffset = 0;
+		region.bufferOffset = bufferOffset;
 		region.bufferRowLength = 0;
 		region.bufferImageHeight = 0;
 		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -1403,8 +1668,25 @@ protected:
 
 		vkCmdCopyBufferToImage(commandBuffer, buffer, image,
 			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+	}
+
+	// Fills a device local buffer created with TRANSFER_DST usage through a staging buffer.
+	// The copy is recorded in the open upload batch; any later frame may read the buffer.
+	void uploadBuffer(VkBuffer dstBuffer, const void* src, VkDeviceSize size) {
+		UploadQueue::StagingRegion staging = uploads.stage(size);
+		memcpy(staging.data, src, (size_t)size);
+
+		copyBuffer(uploads.transferCommands(), staging.buffer, dstBuffer, size, staging.offset);
+		uploads.handOverBuffer(dstBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_ACCESS_MEMORY_READ_BIT);
+	}
 
-		endSingleTimeCommands(commandBuffer);
+	void copyBuffer(VkCommandBuffer commandBuffer, VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size,
+		VkDeviceSize srcOffset = 0) {
+		VkBufferCopy copyRegion{};
+		copyRegion.srcOffset = srcOffset;
+		copyRegion.dstOffset = 0;
+		copyRegion.size = size;
+		vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
 	}
 
 	VkCommandBuffer beginSingleTimeCommands() {
@@ -1433,15 +1715,22 @@ protected:
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 		submitInfo.commandBufferCount = 1;
 		submitInfo.pCommandBuffers = &commandBuffer;
-		vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-		vkQueueWaitIdle(graphicsQueue);
+
+		// Waits for this submission only, not for everything else on the queue
+		VkFenceCreateInfo fenceInfo{};
+		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+		VkFence fence;
+		vkCreateFence(device, &fenceInfo, nullptr, &fence);
+		vkQueueSubmit(graphicsQueue, 1, &submitInfo, fence);
+		vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+		vkDestroyFence(device, fence, nullptr);
 
 		vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
 	}
 
 	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
 		VkMemoryPropertyFlags properties,
-		VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+		VkBuffer& buffer, MemoryAllocation& bufferMemory) {
 		VkBufferCreateInfo bufferInfo{};
 		bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 		bufferInfo.size = size;
@@ -1458,20 +1747,9 @@ protected:
 		VkMemoryRequirements memRequirements;
 		vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 
-		VkMemoryAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.allocationSize = memRequirements.size;
-		allocInfo.memoryTypeIndex =
-			findMemoryType(memRequirements.memoryTypeBits, properties);
-
-		result = vkAllocateMemory(device, &allocInfo, nullptr,
-			&bufferMemory);
-		if (result != VK_SUCCESS) {
-			PrintVkError(result);
-			throw std::runtime_error("failed to allocate vertex buffer memory!");
-		}
-
-		vkBindBufferMemory(device, buffer, bufferMemory, 0);
+		bufferMemory = memoryAllocator.allocate(memRequirements,
+			findMemoryType(memRequirements.memoryTypeBits, properties), true);
+		vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);
 	}
 
 	uint32_t findMemoryType(uint32_t typeFilter,
@@ -1491,13 +1769,23 @@ protected:
 	}
 
 	void createDescriptorPool() {
-		std::array<VkDescriptorPoolSize, 2> poolSizes{};
-		poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		poolSizes[0].descriptorCount = static_cast<uint32_t>(uniformBlocksInPool *
-			swapChainImages.size());
-		poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-		poolSizes[1].descriptorCount = static_cast<uint32_t>(texturesInPool *
-			swapChainImages.size());
+		std::vector<VkDescriptorPoolSize> poolSizes;
+		std::pair<VkDescriptorType, int> counts[] = {
+			{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, uniformBlocksInPool },
+			{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, texturesInPool },
+			{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, storageBuffersInPool },
+			{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, dynamicUniformBlocksInPool },
+			{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, storageImagesInPool }
+		};
+		for (const auto& count : counts) {
+			if (count.second > 0) {
+				VkDescriptorPoolSize poolSize{};
+				poolSize.type = count.first;
+				poolSize.descriptorCount = static_cast<uint32_t>(count.second *
+					swapChainImages.size());
+				poolSizes.push_back(poolSize);
+			}
+		}
 
 		VkDescriptorPoolCreateInfo poolInfo{};
 		poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -1515,9 +1803,47 @@ protected:
 
 	virtual void populateCommandBuffer(VkCommandBuffer commandBuffer, int i) = 0;
 
+	// Without recordEveryFrame: whether what the command buffer of image i was recorded with
+	// has changed since, in which case drawFrame records it again
+	virtual bool commandBufferOutdated(int i) { return false; }
+
+	// Records work that must run outside the render pass, before it (e.g. compute dispatches)
+	virtual void populateComputeCommandBuffer(VkCommandBuffer commandBuffer, int i) {}
+
+	// Parallel recording: the number of draws of image i, and the recording of draws [begin, end)
+	// into a secondary command buffer. Called concurrently for disjoint ranges; nothing is
+	// inherited between ranges, so each one binds every pipeline and set it uses.
+	virtual int drawListSize(int i) { return 0; }
+	virtual void populateDrawRange(VkCommandBuffer commandBuffer, int i, int begin, int end) {}
+
 	void createCommandBuffers() {
 		commandBuffers.resize(swapChainFramebuffers.size());
 
+		if (recordEveryFrame) {
+			// One buffer per pool, recorded in drawFrame once its image is acquired
+			frameCommandPools.resize(commandBuffers.size());
+			for (size_t i = 0; i < commandBuffers.size(); i++) {
+				frameCommandPools[i] = createFrameCommandPool();
+
+				VkCommandBufferAllocateInfo allocInfo{};
+				allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+				allocInfo.commandPool = frameCommandPools[i];
+				allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+				allocInfo.commandBufferCount = 1;
+
+				VkResult result = vkAllocateCommandBuffers(device, &allocInfo,
+					&commandBuffers[i]);
+				if (result != VK_SUCCESS) {
+					PrintVkError(result);
+					throw std::runtime_error("failed to allocate command buffers!");
+				}
+			}
+			if (recordingPool) {
+				createSecondaryCommandBuffers();
+			}
+			return;
+		}
+
 		VkCommandBufferAllocateInfo allocInfo{};
 		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 		allocInfo.commandPool = commandPool;
@@ -1532,44 +1858,167 @@ protected:
 		}
 
 		for (size_t i = 0; i < commandBuffers.size(); i++) {
-			VkCommandBufferBeginInfo beginInfo{};
-			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-			beginInfo.flags = 0; // Optional
-			beginInfo.pInheritanceInfo = nullptr; // Optional
-
-			if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) !=
-				VK_SUCCESS) {
-				throw std::runtime_error("failed to begin recording command buffer!");
+			recordCommandBuffer(static_cast<int>(i));
+		}
+	}
+
+	void createSecondaryCommandBuffers() {
+		int slices = recordingPool->size();
+		secondaryCommandPools.assign(commandBuffers.size(), std::vector<VkCommandPool>(slices));
+		secondaryCommandBuffers.assign(commandBuffers.size(), std::vector<VkCommandBuffer>(slices));
+		for (size_t i = 0; i < commandBuffers.size(); i++) {
+			for (int s = 0; s < slices; s++) {
+				secondaryCommandPools[i][s] = createFrameCommandPool();
+
+				VkCommandBufferAllocateInfo allocInfo{};
+				allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+				allocInfo.commandPool = secondaryCommandPools[i][s];
+				allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+				allocInfo.commandBufferCount = 1;
+
+				VkResult result = vkAllocateCommandBuffers(device, &allocInfo,
+					&secondaryCommandBuffers[i][s]);
+				if (result != VK_SUCCESS) {
+					PrintVkError(result);
+					throw std::runtime_error("failed to allocate secondary command buffers!");
+				}
 			}
+		}
+	}
 
-			VkRenderPassBeginInfo renderPassInfo{};
-			renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-			renderPassInfo.renderPass = renderPass;
-			renderPassInfo.framebuffer = swapChainFramebuffers[i];
-			renderPassInfo.renderArea.offset = { 0, 0 };
-			renderPassInfo.renderArea.extent = swapChainExtent;
+	VkCommandPool createFrameCommandPool() {
+		QueueFamilyIndices queueFamilyIndices =
+			findQueueFamilies(physicalDevice);
 
-			std::array<VkClearValue, 2> clearValues{};
-			clearValues[0].color = initialBackgroundColor;
-			clearValues[1].depthStencil = { 1.0f, 0 };
+		VkCommandPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
 
-			renderPassInfo.clearValueCount =
-				static_cast<uint32_t>(clearValues.size());
-			renderPassInfo.pClearValues = clearValues.data();
+		VkCommandPool pool;
+		VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr, &pool);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create command pool!");
+		}
+		return pool;
+	}
+
+	void recordCommandBuffer(int i) {
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = recordEveryFrame ? VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT : 0;
+		beginInfo.pInheritanceInfo = nullptr; // Optional
+
+		if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) !=
+			VK_SUCCESS) {
+			throw std::runtime_error("failed to begin recording command buffer!");
+		}
+
+		populateComputeCommandBuffer(commandBuffers[i], i);
 
-			vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo,
-				VK_SUBPASS_CONTENTS_INLINE);
+		bool secondary = !secondaryCommandBuffers.empty();
+		beginRenderPass(commandBuffers[i], i,
+			secondary ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
 
 
+		if (secondary) {
+			recordSecondaryCommandBuffers(i);
+		}
+		else {
 			populateCommandBuffer(commandBuffers[i], i);
+		}
+
 
+		vkCmdEndRenderPass(commandBuffers[i]);
+
+		if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
+			throw std::runtime_error("failed to record command buffer!");
+		}
+	}
 
-			vkCmdEndRenderPass(commandBuffers[i]);
+	// Clears and begins the render pass on the framebuffer of image i
+	void beginRenderPass(VkCommandBuffer commandBuffer, int i, VkSubpassContents contents) {
+		VkRenderPassBeginInfo renderPassInfo{};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		renderPassInfo.renderPass = renderPass;
+		renderPassInfo.framebuffer = swapChainFramebuffers[i];
+		renderPassInfo.renderArea.offset = { 0, 0 };
+		renderPassInfo.renderArea.extent = swapChainExtent;
 
-			if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-				throw std::runtime_error("failed to record command buffer!");
+		std::array<VkClearValue, 2> clearValues{};
+		clearValues[0].color = initialBackgroundColor;
+		clearValues[1].depthStencil = { 1.0f, 0 };
+
+		renderPassInfo.clearValueCount =
+			static_cast<uint32_t>(clearValues.size());
+		renderPassInfo.pClearValues = clearValues.data();
+
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, contents);
+	}
+
+	// Records the slices of the draw list of image i on the workers of recordingPool, and
+	// executes the non-empty ones from its primary buffer in draw list order
+	void recordSecondaryCommandBuffers(int i) {
+		int slices = static_cast<int>(secondaryCommandBuffers[i].size());
+		int draws = drawListSize(i);
+		std::atomic<bool> failed{ false };
+
+		recordingPool->parallelFor(slices, 1, [&](int begin, int end) {
+			for (int s = begin; s < end; s++) {
+				VkCommandBuffer commandBuffer = secondaryCommandBuffers[i][s];
+				vkResetCommandPool(device, secondaryCommandPools[i][s], 0);
+
+				VkCommandBufferInheritanceInfo inheritanceInfo{};
+				inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+				inheritanceInfo.renderPass = renderPass;
+				inheritanceInfo.subpass = 0;
+				inheritanceInfo.framebuffer = swapChainFramebuffers[i];
+
+				VkCommandBufferBeginInfo beginInfo{};
+				beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+				beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+					VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+				beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+				// Exceptions must not leave a worker thread, failures are reported below
+				if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+					failed = true;
+					continue;
+				}
+				populateDrawRange(commandBuffer, i, draws * s / slices, draws * (s + 1) / slices);
+				if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+					failed = true;
+				}
+			}
+		});
+		if (failed) {
+			throw std::runtime_error("failed to record secondary command buffer!");
+		}
+
+		std::vector<VkCommandBuffer> recorded;
+		for (int s = 0; s < slices; s++) {
+			if (draws * s / slices < draws * (s + 1) / slices) {
+				recorded.push_back(secondaryCommandBuffers[i][s]);
 			}
 		}
+		if (!recorded.empty()) {
+			vkCmdExecuteCommands(commandBuffers[i], static_cast<uint32_t>(recorded.size()),
+				recorded.data());
+		}
+	}
+
+	// Resets the pool of an image whose previous submission has completed and records it again
+	void rerecordCommandBuffer(uint32_t imageIndex) {
+		auto start = std::chrono::high_resolution_clock::now();
+
+		vkResetCommandPool(device, frameCommandPools[imageIndex], 0);
+		recordCommandBuffer(static_cast<int>(imageIndex));
+
+		auto end = std::chrono::high_resolution_clock::now();
+		commandRecordMs = std::chrono::duration<double, std::milli>(end - start).count();
+		commandRecordMsAverage = commandRecordMsAverage == 0.0 ? commandRecordMs :
+			0.95 * commandRecordMsAverage + 0.05 * commandRecordMs;
 	}
 
 	void createSyncObjects() {
@@ -1637,6 +2086,19 @@ protected:
 
 		updateUniformBuffer(imageIndex);
 
+		if (recordEveryFrame) {
+			rerecordCommandBuffer(imageIndex);
+		}
+		else if (commandBufferOutdated(static_cast<int>(imageIndex))) {
+			// The previous submission of this image has completed, its buffer is free to reset
+			vkResetCommandBuffer(commandBuffers[imageIndex], 0);
+			recordCommandBuffer(static_cast<int>(imageIndex));
+		}
+
+		// Uploads recorded since the last frame go first, so this frame can use them
+		uploads.flush();
+		uploads.collect();
+
 		VkSubmitInfo submitInfo{};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 		VkSemaphore waitSemaphores[] = { imageAvailableSemaphores[currentFrame] };
@@ -1708,6 +2170,7 @@ protected:
 		createDepthResources();
 		createFramebuffers();
 		createDescriptorPool();
+		uniformRing.init(this, uniformRingFrameSize, static_cast<int>(swapChainImages.size()));
 
 		pipelinesAndDescriptorSetsInit();
 
@@ -1717,18 +2180,34 @@ protected:
 	void cleanupSwapChain() {
 		vkDestroyImageView(device, colorImageView, nullptr);
 		vkDestroyImage(device, colorImage, nullptr);
-		vkFreeMemory(device, colorImageMemory, nullptr);
+		memoryAllocator.free(colorImageMemory);
 
 		vkDestroyImageView(device, depthImageView, nullptr);
 		vkDestroyImage(device, depthImage, nullptr);
-		vkFreeMemory(device, depthImageMemory, nullptr);
+		memoryAllocator.free(depthImageMemory);
 
 		for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
 			vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
 		}
 
-		vkFreeCommandBuffers(device, commandPool,
-			static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+		if (frameCommandPools.empty()) {
+			vkFreeCommandBuffers(device, commandPool,
+				static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+		}
+		else {
+			// Destroying a pool frees the command buffer allocated from it
+			for (VkCommandPool pool : frameCommandPools) {
+				vkDestroyCommandPool(device, pool, nullptr);
+			}
+			frameCommandPools.clear();
+			for (std::vector<VkCommandPool>& pools : secondaryCommandPools) {
+				for (VkCommandPool pool : pools) {
+					vkDestroyCommandPool(device, pool, nullptr);
+				}
+			}
+			secondaryCommandPools.clear();
+			secondaryCommandBuffers.clear();
+		}
 
 		pipelinesAndDescriptorSetsCleanup();
 
@@ -1741,6 +2220,7 @@ protected:
 		vkDestroySwapchainKHR(device, swapChain, nullptr);
 
 		vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+		uniformRing.cleanup();
 	}
 
 	void cleanup() {
@@ -1754,8 +2234,10 @@ protected:
 			vkDestroyFence(device, inFlightFences[i], nullptr);
 		}
 
+		uploads.cleanup();
 		vkDestroyCommandPool(device, commandPool, nullptr);
 
+		memoryAllocator.destroy();
 		vkDestroyDevice(device, nullptr);
 
 		DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
@@ -1807,14 +2289,13 @@ protected:
 	}
 
 	void getSixAxis(float& deltaT, glm::vec3& m, glm::vec3& r, bool& fire) {
-		static auto startTime = std::chrono::high_resolution_clock::now();
-		static float lastTime = 0.0f;
+		static auto lastTime = std::chrono::high_resolution_clock::now();
 
+		// Measured between consecutive frames, so it does not lose precision as the session grows
 		auto currentTime = std::chrono::high_resolution_clock::now();
-		float time = std::chrono::duration<float, std::chrono::seconds::period>
-			(currentTime - startTime).count();
-		deltaT = time - lastTime;
-		lastTime = time;
+		deltaT = std::chrono::duration<float, std::chrono::seconds::period>
+			(currentTime - lastTime).count();
+		lastTime = currentTime;
 
 		static double old_xpos = 0, old_ypos = 0;
 		double xpos, ypos;
@@ -1921,8 +2402,12 @@ void VertexDescriptor::init(BaseProject* bp, std::vector<VertexBindingDescriptor
 	Color.hasIt = false; Color.offset = 0;
 	Tangent.hasIt = false; Tangent.offset = 0;
 
-	if (B.size() == 1) {	// for now, read models only with every vertex information in a single binding
+	// Models are read with every vertex information in binding 0, further bindings carry per-instance data
+	if (B.size() >= 1) {
 		for (int i = 0; i < E.size(); i++) {
+			if (E[i].binding != 0) {
+				continue;
+			}
 			switch (E[i].usage) {
 			case VertexDescriptorElementUsage::POSITION:
 				if (E[i].format == VK_FORMAT_R32G32B32_SFLOAT) {
@@ -2000,7 +2485,104 @@ void VertexDescriptor::init(BaseProject* bp, std::vector<VertexBindingDescriptor
 		}
 	}
 	else {
-		throw std::runtime_error("Vertex format with more than one binding is not supported yet\n");
+		throw std::runtime_error("Vertex format without bindings\n");
+	}
+}
+
+// Replaces the float elements of binding 0 with compact ones for the GPU. Only the known
+// vertex components can be encoded; UVs are clamped to [0, 1].
+void VertexDescriptor::usePackedLayout() {
+	PackedLayout.clear();
+	packedStride = 0;
+	for (const VertexDescriptorElement& e : Layout) {
+		if (e.binding != 0) {
+			continue;
+		}
+		VertexDescriptorElement p = e;
+		switch (e.usage) {
+		case VertexDescriptorElementUsage::POSITION:
+			p.format = VK_FORMAT_R16G16B16A16_SFLOAT;
+			p.size = 8;
+			break;
+		case VertexDescriptorElementUsage::NORMAL:
+			p.format = VK_FORMAT_R16G16_SNORM;
+			p.size = 4;
+			break;
+		case VertexDescriptorElementUsage::UV:
+			p.format = VK_FORMAT_R16G16_UNORM;
+			p.size = 4;
+			break;
+		case VertexDescriptorElementUsage::COLOR:
+			p.format = VK_FORMAT_R8G8B8A8_UNORM;
+			p.size = 4;
+			break;
+		case VertexDescriptorElementUsage::TANGENT:
+			p.format = VK_FORMAT_R16G16B16A16_SNORM;
+			p.size = 8;
+			break;
+		default:
+			throw std::runtime_error("Vertex element without a packed format\n");
+		}
+		p.offset = packedStride;
+		packedStride += p.size;
+		PackedLayout.push_back(p);
+	}
+	packed = true;
+}
+
+// Octahedral encoding: the unit sphere folded onto the [-1, 1] square
+static glm::vec2 octEncode(const float* n) {
+	float l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+	if (l1 == 0.0f) {
+		return glm::vec2(0.0f, 0.0f);
+	}
+	float x = n[0] / l1, y = n[1] / l1;
+	if (n[2] < 0.0f) {
+		float fx = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float fy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = fx;
+		y = fy;
+	}
+	return glm::vec2(x, y);
+}
+
+// Encodes count vertices of the given stride, laid out as Layout, into PackedLayout
+void VertexDescriptor::pack(const void* vertices, size_t count, uint32_t stride, std::vector<uint8_t>& out) const {
+	out.assign(count * packedStride, 0);
+	const uint8_t* src = static_cast<const uint8_t*>(vertices);
+	for (size_t i = 0; i < count; i++, src += stride) {
+		uint8_t* dst = &out[i * packedStride];
+		size_t p = 0;
+		for (const VertexDescriptorElement& e : Layout) {
+			if (e.binding != 0) {
+				continue;
+			}
+			const float* f = reinterpret_cast<const float*>(src + e.offset);
+			uint32_t w[2] = { 0, 0 };
+			switch (e.usage) {
+			case VertexDescriptorElementUsage::POSITION:
+				w[0] = glm::packHalf2x16(glm::vec2(f[0], f[1]));
+				w[1] = glm::packHalf2x16(glm::vec2(f[2], 1.0f));
+				break;
+			case VertexDescriptorElementUsage::NORMAL:
+				w[0] = glm::packSnorm2x16(octEncode(f));
+				break;
+			case VertexDescriptorElementUsage::UV:
+				w[0] = glm::packUnorm2x16(glm::vec2(glm::clamp(f[0], 0.0f, 1.0f), glm::clamp(f[1], 0.0f, 1.0f)));
+				break;
+			case VertexDescriptorElementUsage::COLOR:
+				w[0] = glm::packUnorm4x8(glm::vec4(f[0], f[1], f[2], 1.0f));
+				break;
+			case VertexDescriptorElementUsage::TANGENT:
+				w[0] = glm::packSnorm2x16(glm::vec2(f[0], f[1]));
+				w[1] = glm::packSnorm2x16(glm::vec2(f[2], f[3]));
+				break;
+			default:
+				break;
+			}
+			memcpy(dst + PackedLayout[p].offset, w, PackedLayout[p].size);
+			p++;
+		}
 	}
 }
 
@@ -2012,7 +2594,7 @@ std::vector<VkVertexInputBindingDescription> VertexDescriptor::getBindingDescrip
 	bindingDescription.resize(Bindings.size());
 	for (int i = 0; i < Bindings.size(); i++) {
 		bindingDescription[i].binding = Bindings[i].binding;
-		bindingDescription[i].stride = Bindings[i].stride;
+		bindingDescription[i].stride = (packed && Bindings[i].binding == 0) ? packedStride : Bindings[i].stride;
 		bindingDescription[i].inputRate = Bindings[i].inputRate;
 	}
 	return bindingDescription;
@@ -2021,11 +2603,13 @@ std::vector<VkVertexInputBindingDescription> VertexDescriptor::getBindingDescrip
 std::vector<VkVertexInputAttributeDescription> VertexDescriptor::getAttributeDescriptions() {
 	std::vector<VkVertexInputAttributeDescription> attributeDescriptions{};
 	attributeDescriptions.resize(Layout.size());
+	size_t p = 0;
 	for (int i = 0; i < Layout.size(); i++) {
-		attributeDescriptions[i].binding = Layout[i].binding;
-		attributeDescriptions[i].location = Layout[i].location;
-		attributeDescriptions[i].format = Layout[i].format;
-		attributeDescriptions[i].offset = Layout[i].offset;
+		const VertexDescriptorElement& e = (packed && Layout[i].binding == 0) ? PackedLayout[p++] : Layout[i];
+		attributeDescriptions[i].binding = e.binding;
+		attributeDescriptions[i].location = e.location;
+		attributeDescriptions[i].format = e.format;
+		attributeDescriptions[i].offset = e.offset;
 	}
 
 	return attributeDescriptions;
@@ -2096,8 +2680,21 @@ void Model<Vert>::loadModelOBJ(std::string file) {
 			indices.push_back(vertices.size() - 1);
 		}
 	}
-	std::cout << "[OBJ] Vertices: " << vertices.size() << "\n";
-	std::cout << "Indices: " << indices.size() << "\n";
+
+	// OBJ corners are emitted one vertex each: weld the shared ones, then order the
+	// triangles for the vertex cache and for early depth rejection
+	size_t cornerCount = vertices.size();
+	weldVertices(vertices, indices);
+	optimizeVertexCache(indices, vertices.size());
+	if (VD->Position.hasIt && !vertices.empty()) {
+		optimizeOverdraw(indices, reinterpret_cast<const float*>((char*)vertices.data() + VD->Position.offset),
+			sizeof(Vert), vertices.size());
+	}
+	optimizeVertexFetch(vertices, indices);
+
+	std::cout << "[OBJ] Vertices: " << vertices.size() << " (welded from " << cornerCount << ")\n";
+	std::cout << "Indices: " << indices.size() << ", cache misses per triangle: "
+		<< averageCacheMissRatio(indices, vertices.size()) << "\n";
 
 }
 
@@ -2310,32 +2907,82 @@ void Model<Vert>::loadModelGLTF(std::string file, bool encoded) {
 
 template <class Vert>
 void Model<Vert>::createVertexBuffer() {
-	VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
-
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		vertexBuffer, vertexBufferMemory);
-
-	void* data;
-	vkMapMemory(BP->device, vertexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, vertices.data(), (size_t)bufferSize);
-	vkUnmapMemory(BP->device, vertexBufferMemory);
+	vertexCount = static_cast<uint32_t>(vertices.size());
+	radius = 0.0f;
+	if (VD->Position.hasIt) {
+		for (const Vert& v : vertices) {
+			radius = std::max(radius, glm::length(*(const glm::vec3*)((const char*)(&v) + VD->Position.offset)));
+		}
+	}
+	if (VD->packed) {
+		std::vector<uint8_t> packedVertices;
+		VD->pack(vertices.data(), vertices.size(), sizeof(Vert), packedVertices);
+		createGeometryBuffer(packedVertices.data(), packedVertices.size(),
+			VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, vertexBuffer, vertexBufferMemory);
+		return;
+	}
+	createGeometryBuffer(vertices.data(), sizeof(vertices[0]) * vertices.size(),
+		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, vertexBuffer, vertexBufferMemory);
 }
 
 template <class Vert>
 void Model<Vert>::createIndexBuffer() {
-	VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
+	indexCount = static_cast<uint32_t>(indices.size());
+	if (vertices.size() <= 65536) {
+		std::vector<uint16_t> shortIndices(indices.begin(), indices.end());
+		indexType = VK_INDEX_TYPE_UINT16;
+		createGeometryBuffer(shortIndices.data(), sizeof(shortIndices[0]) * shortIndices.size(),
+			VK_BUFFER_USAGE_INDEX_BUFFER_BIT, indexBuffer, indexBufferMemory);
+		return;
+	}
+	indexType = VK_INDEX_TYPE_UINT32;
+	createGeometryBuffer(indices.data(), sizeof(indices[0]) * indices.size(),
+		VK_BUFFER_USAGE_INDEX_BUFFER_BIT, indexBuffer, indexBufferMemory);
+}
 
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		indexBuffer, indexBufferMemory);
+// Host visible buffers are written in place, device local ones through a staging copy
+template <class Vert>
+void Model<Vert>::createGeometryBuffer(const void* src, VkDeviceSize size, VkBufferUsageFlags usage,
+	VkBuffer& buffer, MemoryAllocation& memory) {
+	if (hostVisible) {
+		BP->createBuffer(size, usage,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			buffer, memory);
+		memcpy(memory.mapped, src, (size_t)size);
+		return;
+	}
 
-	void* data;
-	vkMapMemory(BP->device, indexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, indices.data(), (size_t)bufferSize);
-	vkUnmapMemory(BP->device, indexBufferMemory);
+	BP->createBuffer(size, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		buffer, memory);
+	BP->uploadBuffer(buffer, src, size);
+}
+
+// Rewrites the vertex buffer from vertices, which must keep their count. The caller makes
+// sure no frame in flight still reads the buffer, and models sharing it see the change too.
+template <class Vert>
+void Model<Vert>::updateVertexBuffer() {
+	if (!hostVisible) {
+		throw std::runtime_error("updateVertexBuffer needs a host visible model");
+	}
+	if (vertices.size() != vertexCount) {
+		throw std::runtime_error("updateVertexBuffer needs all the vertices of the model");
+	}
+	if (VD->packed) {
+		std::vector<uint8_t> packedVertices;
+		VD->pack(vertices.data(), vertices.size(), sizeof(Vert), packedVertices);
+		memcpy(vertexBufferMemory.mapped, packedVertices.data(), packedVertices.size());
+		return;
+	}
+	memcpy(vertexBufferMemory.mapped, vertices.data(), sizeof(vertices[0]) * vertices.size());
+}
+
+// The staging copies already hold the data, so the host copy can go right away
+template <class Vert>
+void Model<Vert>::releaseGeometry() {
+	std::vector<Vert>().swap(vertices);
+	std::vector<uint32_t>().swap(indices);
 }
 
 template <class Vert>
@@ -2346,12 +2993,53 @@ void Model<Vert>::initMesh(BaseProject* bp, VertexDescriptor* vd) {
 		<< "\nIndices: " << indices.size() << "\n";
 	createVertexBuffer();
 	createIndexBuffer();
+	if (!keepGeometry) {
+		releaseGeometry();
+	}
+}
+
+// The vertex layout part of the key: vertex size, placement, stride and the elements read from the file
+template <class Vert>
+std::string Model<Vert>::cacheKey(const std::string& file, ModelType MT) {
+	std::string key = file + "|" + std::to_string((int)MT) + "|" + std::to_string(sizeof(Vert)) +
+		(hostVisible ? "|host" : "") + (VD->packed ? "|packed" : "");
+	for (const VertexBindingDescriptorElement& b : VD->Bindings) {
+		if (b.binding == 0) {
+			key += "|" + std::to_string(b.stride);
+		}
+	}
+	for (const VertexDescriptorElement& e : VD->Layout) {
+		if (e.binding == 0) {
+			key += "|" + std::to_string((int)e.usage) + ":" + std::to_string((int)e.format) +
+				":" + std::to_string(e.offset);
+		}
+	}
+	return key;
 }
 
 template <class Vert>
 void Model<Vert>::init(BaseProject* bp, VertexDescriptor* vd, std::string file, ModelType MT) {
 	BP = bp;
 	VD = vd;
+
+	// Same file and layout loaded before: share its buffers, skip parsing and allocation.
+	// Only the first model of a mesh holds its vertices and indices on the host.
+	meshKey = cacheKey(file, MT);
+	auto cached = BP->meshCache.find(meshKey);
+	if (cached != BP->meshCache.end()) {
+		mesh = &cached->second;
+		mesh->refCount++;
+		vertexCount = mesh->vertexCount;
+		indexCount = mesh->indexCount;
+		radius = mesh->radius;
+		vertexBuffer = mesh->vertexBuffer;
+		vertexBufferMemory = mesh->vertexBufferMemory;
+		indexBuffer = mesh->indexBuffer;
+		indexBufferMemory = mesh->indexBufferMemory;
+		indexType = mesh->indexType;
+		return;
+	}
+
 	if (MT == OBJ) {
 		loadModelOBJ(file);
 	}
@@ -2364,14 +3052,37 @@ void Model<Vert>::init(BaseProject* bp, VertexDescriptor* vd, std::string file,
 
 	createVertexBuffer();
 	createIndexBuffer();
+
+	mesh = &BP->meshCache[meshKey];
+	mesh->vertexBuffer = vertexBuffer;
+	mesh->vertexBufferMemory = vertexBufferMemory;
+	mesh->indexBuffer = indexBuffer;
+	mesh->indexBufferMemory = indexBufferMemory;
+	mesh->indexType = indexType;
+	mesh->vertexCount = vertexCount;
+	mesh->indexCount = indexCount;
+	mesh->radius = radius;
+	mesh->refCount = 1;
+	if (!keepGeometry) {
+		releaseGeometry();
+	}
 }
 
+// Cached buffers are destroyed when their last user is cleaned up
 template <class Vert>
 void Model<Vert>::cleanup() {
+	if (mesh) {
+		bool lastUser = --mesh->refCount == 0;
+		mesh = nullptr;
+		if (!lastUser) {
+			return;
+		}
+		BP->meshCache.erase(meshKey);
+	}
 	vkDestroyBuffer(BP->device, indexBuffer, nullptr);
-	vkFreeMemory(BP->device, indexBufferMemory, nullptr);
+	BP->memoryAllocator.free(indexBufferMemory);
 	vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
-	vkFreeMemory(BP->device, vertexBufferMemory, nullptr);
+	BP->memoryAllocator.free(vertexBufferMemory);
 }
 
 template <class Vert>
@@ -2381,8 +3092,7 @@ void Model<Vert>::bind(VkCommandBuffer commandBuffer) {
 	VkDeviceSize offsets[] = { 0 };
 	vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
 	// property .indexBuffer of models, contains the VkBuffer handle to its index buffer
-	vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0,
-		VK_INDEX_TYPE_UINT32);
+	vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, indexType);
 }
 
 
@@ -2393,7 +3103,7 @@ void Model<Vert>::bind(VkCommandBuffer commandBuffer) {
 void Texture::createTextureImage(const char* const files[], VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB) {
 	int texWidth, texHeight, texChannels;
 	int curWidth = -1, curHeight = -1, curChannels = -1;
-	stbi_uc* pixels[maxImgs];
+	std::vector<stbi_uc*> pixels(imgs);
 
 	for (int i = 0; i < imgs; i++) {
 		pixels[i] = stbi_load(files[i], &texWidth, &texHeight,
@@ -2424,39 +3134,30 @@ void Texture::createTextureImage(const char* const files[], VkFormat Fmt = VK_FO
 	mipLevels = static_cast<uint32_t>(std::floor(
 		std::log2(std::max(texWidth, texHeight)))) + 1;
 
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-
-	BP->createBuffer(totalImageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		stagingBuffer, stagingBufferMemory);
-	void* data;
-	vkMapMemory(BP->device, stagingBufferMemory, 0, totalImageSize, 0, &data);
+	UploadQueue& uploads = BP->uploads;
+	UploadQueue::StagingRegion staging = uploads.stage(totalImageSize);
 	for (int i = 0; i < imgs; i++) {
-		memcpy(static_cast<char*>(data) + imageSize * i, pixels[i], static_cast<size_t>(imageSize));
+		memcpy(static_cast<char*>(staging.data) + imageSize * i, pixels[i], static_cast<size_t>(imageSize));
 		stbi_image_free(pixels[i]);
 	}
-	vkUnmapMemory(BP->device, stagingBufferMemory);
 
 
 	BP->createImage(texWidth, texHeight, mipLevels, imgs, VK_SAMPLE_COUNT_1_BIT, Fmt,
 		VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
 		VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-		imgs == 6 ? VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT : 0,
+		viewType == VK_IMAGE_VIEW_TYPE_CUBE ? VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT : 0,
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage,
 		textureImageMemory);
 
-	BP->transitionImageLayout(textureImage, Fmt,
+	// The copy runs on the transfer queue, the mipmap blits need the graphics queue
+	BP->transitionImageLayout(uploads.transferCommands(), textureImage, Fmt,
 		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels, imgs);
-	BP->copyBufferToImage(stagingBuffer, textureImage,
-		static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight), imgs);
+	BP->copyBufferToImage(uploads.transferCommands(), staging.buffer, textureImage,
+		static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight), imgs, staging.offset);
+	uploads.handOverImage(textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels, imgs);
 
-	BP->generateMipmaps(textureImage, Fmt,
+	BP->generateMipmaps(uploads.graphicsCommands(), textureImage, Fmt,
 		texWidth, texHeight, mipLevels, imgs);
-
-	vkDestroyBuffer(BP->device, stagingBuffer, nullptr);
-	vkFreeMemory(BP->device, stagingBufferMemory, nullptr);
 }
 
 void Texture::createTextureImageView(VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB) {
@@ -2464,7 +3165,7 @@ void Texture::createTextureImageView(VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB) {
 		Fmt,
 		VK_IMAGE_ASPECT_COLOR_BIT,
 		mipLevels,
-		imgs == 6 ? VK_IMAGE_VIEW_TYPE_CUBE : VK_IMAGE_VIEW_TYPE_2D,
+		viewType,
 		imgs);
 }
 
@@ -2510,6 +3211,7 @@ void Texture::init(BaseProject* bp, const char* file, VkFormat Fmt = VK_FORMAT_R
 	const char* files[1] = { file };
 	BP = bp;
 	imgs = 1;
+	viewType = VK_IMAGE_VIEW_TYPE_2D;
 	createTextureImage(files, Fmt);
 	createTextureImageView(Fmt);
 	if (initSampler) {
@@ -2521,17 +3223,32 @@ void Texture::init(BaseProject* bp, const char* file, VkFormat Fmt = VK_FORMAT_R
 void Texture::initCubic(BaseProject* bp, const char* files[6]) {
 	BP = bp;
 	imgs = 6;
+	viewType = VK_IMAGE_VIEW_TYPE_CUBE;
 	createTextureImage(files);
 	createTextureImageView();
 	createTextureSampler();
 }
 
+// One layer per file, all images must have the same size
+void Texture::initArray(BaseProject* bp, const std::vector<std::string>& files) {
+	std::vector<const char*> names;
+	for (const std::string& f : files) {
+		names.push_back(f.c_str());
+	}
+	BP = bp;
+	imgs = static_cast<int>(files.size());
+	viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+	createTextureImage(names.data());
+	createTextureImageView();
+	createTextureSampler();
+}
+
 
 void Texture::cleanup() {
 	vkDestroySampler(BP->device, textureSampler, nullptr);
 	vkDestroyImageView(BP->device, textureImageView, nullptr);
 	vkDestroyImage(BP->device, textureImage, nullptr);
-	vkFreeMemory(BP->device, textureImageMemory, nullptr);
+	BP->memoryAllocator.free(textureImageMemory);
 }
 
 
@@ -2782,6 +3499,699 @@ void Pipeline::cleanup() {
 	vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
 }
 
+void ComputePipeline::init(BaseProject* bp, const std::string& CompShader,
+	std::vector<DescriptorSetLayout*> d) {
+	BP = bp;
+
+	auto compShaderCode = readFile(CompShader);
+	std::cout << "Compute shader <" << CompShader << "> len: " <<
+		compShaderCode.size() << "\n";
+
+	compShaderModule =
+		createShaderModule(compShaderCode);
+
+	D = d;
+}
+
+void ComputePipeline::create() {
+	VkPipelineShaderStageCreateInfo compShaderStageInfo{};
+	compShaderStageInfo.sType =
+		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	compShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	compShaderStageInfo.module = compShaderModule;
+	compShaderStageInfo.pName = "main";
+
+	std::vector<VkDescriptorSetLayout> DSL(D.size());
+	for (int i = 0; i < D.size(); i++) {
+		DSL[i] = D[i]->descriptorSetLayout;
+	}
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType =
+		VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = DSL.size();
+	pipelineLayoutInfo.pSetLayouts = DSL.data();
+	pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
+	pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
+
+	VkResult result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
+		&pipelineLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create compute pipeline layout!");
+	}
+
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType =
+		VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage = compShaderStageInfo;
+	pipelineInfo.layout = pipelineLayout;
+	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
+	pipelineInfo.basePipelineIndex = -1; // Optional
+
+	result = vkCreateComputePipelines(BP->device, VK_NULL_HANDLE, 1,
+		&pipelineInfo, nullptr, &computePipeline);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create compute pipeline!");
+	}
+}
+
+void ComputePipeline::destroy() {
+	vkDestroyShaderModule(BP->device, compShaderModule, nullptr);
+}
+
+void ComputePipeline::bind(VkCommandBuffer commandBuffer) {
+	vkCmdBindPipeline(commandBuffer,
+		VK_PIPELINE_BIND_POINT_COMPUTE,
+		computePipeline);
+}
+
+// Launches enough groups of groupSize invocations (the shader's local_size_x) to cover items
+void ComputePipeline::dispatch(VkCommandBuffer commandBuffer, uint32_t items, uint32_t groupSize) {
+	vkCmdDispatch(commandBuffer, (items + groupSize - 1) / groupSize, 1, 1);
+}
+
+VkShaderModule ComputePipeline::createShaderModule(const std::vector<char>& code) {
+	VkShaderModuleCreateInfo createInfo{};
+	createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	createInfo.codeSize = code.size();
+	createInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
+
+	VkShaderModule shaderModule;
+
+	VkResult result = vkCreateShaderModule(BP->device, &createInfo, nullptr,
+		&shaderModule);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create shader module!");
+	}
+
+	return shaderModule;
+}
+
+void ComputePipeline::cleanup() {
+	vkDestroyPipeline(BP->device, computePipeline, nullptr);
+	vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
+}
+
+void UniformRingBuffer::init(BaseProject* bp, VkDeviceSize bytesPerFrame, int frames) {
+	BP = bp;
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+	alignment = properties.limits.minUniformBufferOffsetAlignment;
+	frameSize = (bytesPerFrame + alignment - 1) / alignment * alignment;
+	used = 0;
+
+	BP->createBuffer(frameSize * frames, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		buffer, bufferMemory);
+	mapped = static_cast<uint8_t*>(bufferMemory.mapped);
+}
+
+// Reserves an aligned slice of 'size' bytes in the region of every frame
+VkDeviceSize UniformRingBuffer::allocate(VkDeviceSize size) {
+	VkDeviceSize offset = used;
+	VkDeviceSize end = offset + (size + alignment - 1) / alignment * alignment;
+	if (end > frameSize) {
+		throw std::runtime_error("uniform ring buffer is full, raise uniformRingFrameSize!");
+	}
+	used = end;
+	return offset;
+}
+
+void UniformRingBuffer::write(int currentImage, VkDeviceSize offset, const void* src, VkDeviceSize size) {
+	memcpy(mapped + frameSize * currentImage + offset, src, static_cast<size_t>(size));
+}
+
+uint32_t UniformRingBuffer::dynamicOffset(int currentImage, VkDeviceSize offset) const {
+	return static_cast<uint32_t>(frameSize * currentImage + offset);
+}
+
+void UniformRingBuffer::cleanup() {
+	vkDestroyBuffer(BP->device, buffer, nullptr);
+	BP->memoryAllocator.free(bufferMemory);
+}
+
+void InstanceBuffer::init(BaseProject* bp, VkDeviceSize bufferSize) {
+	BP = bp;
+	size = bufferSize;
+	buffers.resize(BP->swapChainImages.size());
+	buffersMemory.resize(BP->swapChainImages.size());
+	for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+		BP->createBuffer(size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			buffers[i], buffersMemory[i]);
+	}
+}
+
+void InstanceBuffer::cleanup() {
+	for (size_t i = 0; i < buffers.size(); i++) {
+		vkDestroyBuffer(BP->device, buffers[i], nullptr);
+		BP->memoryAllocator.free(buffersMemory[i]);
+	}
+}
+
+void InstanceBuffer::map(int currentImage, const void* src, VkDeviceSize dataSize) {
+	memcpy(buffersMemory[currentImage].mapped, src, static_cast<size_t>(dataSize));
+}
+
+void InstanceBuffer::bind(VkCommandBuffer commandBuffer, uint32_t binding, int currentImage) {
+	VkDeviceSize offsets[] = { 0 };
+	vkCmdBindVertexBuffers(commandBuffer, binding, 1, &buffers[currentImage], offsets);
+}
+
+void StorageBuffer::init(BaseProject* bp, VkDeviceSize bufferSize, VkBufferUsageFlags extraUsage,
+	const void* initialData) {
+	BP = bp;
+	size = bufferSize;
+
+	BP->createBuffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT | extraUsage,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		buffer, bufferMemory);
+
+	if (initialData) {
+		BP->uploadBuffer(buffer, initialData, size);
+	}
+}
+
+void StorageBuffer::cleanup() {
+	vkDestroyBuffer(BP->device, buffer, nullptr);
+	BP->memoryAllocator.free(bufferMemory);
+}
+
+void StorageBuffer::bindAsVertexBuffer(VkCommandBuffer commandBuffer, uint32_t binding) {
+	VkDeviceSize offsets[] = { 0 };
+	vkCmdBindVertexBuffers(commandBuffer, binding, 1, &buffer, offsets);
+}
+
+void StorageBuffer::barrier(VkCommandBuffer commandBuffer,
+	VkPipelineStageFlags srcStage, VkAccessFlags srcAccess,
+	VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+	VkBufferMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = srcAccess;
+	barrier.dstAccessMask = dstAccess;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = buffer;
+	barrier.offset = 0;
+	barrier.size = VK_WHOLE_SIZE;
+
+	vkCmdPipelineBarrier(commandBuffer, srcStage, dstStage, 0,
+		0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+void DepthPyramid::init(BaseProject* bp, const std::string& ReduceShader,
+	const std::string& MultisampledShader) {
+	BP = bp;
+	DSL.init(BP, {
+		{0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT},
+		{1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT}
+		});
+	reduce.init(BP, ReduceShader, { &DSL });
+	if (BP->msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+		reduceMultisampled.init(BP, MultisampledShader, { &DSL });
+	}
+}
+
+void DepthPyramid::create() {
+	width = BP->swapChainExtent.width > 1 ? BP->swapChainExtent.width / 2 : 1;
+	height = BP->swapChainExtent.height > 1 ? BP->swapChainExtent.height / 2 : 1;
+	levels = static_cast<uint32_t>(std::floor(std::log2(std::max(width, height)))) + 1;
+	if (levels > MAX_LEVELS) {
+		throw std::runtime_error("depth pyramid has too many levels!");
+	}
+
+	BP->createImage(width, height, levels, 1, VK_SAMPLE_COUNT_1_BIT,
+		VK_FORMAT_R32_SFLOAT, VK_IMAGE_TILING_OPTIMAL,
+		VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 0,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, imageMemory);
+
+	levelViews.resize(levels);
+	for (uint32_t l = 0; l < levels; l++) {
+		VkImageViewCreateInfo viewInfo{};
+		viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		viewInfo.image = image;
+		viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewInfo.format = VK_FORMAT_R32_SFLOAT;
+		viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		viewInfo.subresourceRange.baseMipLevel = l;
+		viewInfo.subresourceRange.levelCount = 1;
+		viewInfo.subresourceRange.baseArrayLayer = 0;
+		viewInfo.subresourceRange.layerCount = 1;
+
+		VkResult result = vkCreateImageView(BP->device, &viewInfo, nullptr, &levelViews[l]);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create depth pyramid view!");
+		}
+	}
+
+	// Texels are read one by one with texelFetch, the sampler only has to exist
+	texture.BP = BP;
+	texture.mipLevels = levels;
+	texture.textureImage = image;
+	texture.textureImageView = BP->createImageView(image, VK_FORMAT_R32_SFLOAT,
+		VK_IMAGE_ASPECT_COLOR_BIT, levels, VK_IMAGE_VIEW_TYPE_2D, 1);
+	texture.createTextureSampler(VK_FILTER_NEAREST, VK_FILTER_NEAREST,
+		VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+		VK_SAMPLER_MIPMAP_MODE_NEAREST, VK_FALSE, 1.0f, static_cast<float>(levels));
+
+	reduce.create();
+	if (BP->msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+		reduceMultisampled.create();
+	}
+
+	// Level l reads the depth buffer (l = 0) or level l - 1, and writes level l
+	std::vector<VkDescriptorSetLayout> layouts(levels, DSL.descriptorSetLayout);
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = BP->descriptorPool;
+	allocInfo.descriptorSetCount = levels;
+	allocInfo.pSetLayouts = layouts.data();
+
+	levelSets.resize(levels);
+	VkResult result = vkAllocateDescriptorSets(BP->device, &allocInfo, levelSets.data());
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate depth pyramid descriptor sets!");
+	}
+
+	for (uint32_t l = 0; l < levels; l++) {
+		VkDescriptorImageInfo sourceInfo{};
+		sourceInfo.sampler = texture.textureSampler;
+		sourceInfo.imageView = l == 0 ? BP->depthImageView : levelViews[l - 1];
+		sourceInfo.imageLayout = l == 0 ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL :
+			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+		VkDescriptorImageInfo destinationInfo{};
+		destinationInfo.imageView = levelViews[l];
+		destinationInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+		std::array<VkWriteDescriptorSet, 2> descriptorWrites{};
+		for (int b = 0; b < 2; b++) {
+			descriptorWrites[b].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			descriptorWrites[b].dstSet = levelSets[l];
+			descriptorWrites[b].dstBinding = b;
+			descriptorWrites[b].dstArrayElement = 0;
+			descriptorWrites[b].descriptorCount = 1;
+		}
+		descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		descriptorWrites[0].pImageInfo = &sourceInfo;
+		descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		descriptorWrites[1].pImageInfo = &destinationInfo;
+
+		vkUpdateDescriptorSets(BP->device, static_cast<uint32_t>(descriptorWrites.size()),
+			descriptorWrites.data(), 0, nullptr);
+	}
+}
+
+void DepthPyramid::build(VkCommandBuffer commandBuffer) {
+	VkFormat depthFormat = BP->findDepthFormat();
+	VkImageAspectFlags depthAspect = VK_IMAGE_ASPECT_DEPTH_BIT |
+		(BP->hasStencilComponent(depthFormat) ? VK_IMAGE_ASPECT_STENCIL_BIT : 0);
+
+	// The depth writes of the last frame must be done before they are read, and the
+	// culling passes of the last frame done with the pyramid before it is overwritten
+	std::array<VkImageMemoryBarrier, 2> barriers{};
+	for (VkImageMemoryBarrier& barrier : barriers) {
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.subresourceRange.baseMipLevel = 0;
+		barrier.subresourceRange.baseArrayLayer = 0;
+		barrier.subresourceRange.layerCount = 1;
+	}
+	barriers[0].image = BP->depthImage;
+	barriers[0].oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	barriers[0].newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+	barriers[0].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	barriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	barriers[0].subresourceRange.aspectMask = depthAspect;
+	barriers[0].subresourceRange.levelCount = 1;
+
+	barriers[1].image = image;
+	barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barriers[1].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	barriers[1].srcAccessMask = 0;
+	barriers[1].dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barriers[1].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barriers[1].subresourceRange.levelCount = levels;
+
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+		0, nullptr, 0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data());
+
+	for (uint32_t l = 0; l < levels; l++) {
+		ComputePipeline& pipeline = (l == 0 && BP->msaaSamples != VK_SAMPLE_COUNT_1_BIT) ?
+			reduceMultisampled : reduce;
+		pipeline.bind(commandBuffer);
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+			pipeline.pipelineLayout, 0, 1, &levelSets[l], 0, nullptr);
+		uint32_t w = std::max(width >> l, 1u);
+		uint32_t h = std::max(height >> l, 1u);
+		vkCmdDispatch(commandBuffer, (w + 7) / 8, (h + 7) / 8, 1);
+
+		// The level is complete, the next one and the culling passes read it
+		VkImageMemoryBarrier barrier = barriers[1];
+		barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		barrier.subresourceRange.baseMipLevel = l;
+		barrier.subresourceRange.levelCount = 1;
+		vkCmdPipelineBarrier(commandBuffer,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+			0, nullptr, 0, nullptr, 1, &barrier);
+	}
+
+	// Back to an attachment, after the first level has read it
+	VkImageMemoryBarrier barrier = barriers[0];
+	barrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+	barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT, 0,
+		0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+void DepthPyramid::cleanup() {
+	reduce.cleanup();
+	if (BP->msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+		reduceMultisampled.cleanup();
+	}
+	vkDestroySampler(BP->device, texture.textureSampler, nullptr);
+	vkDestroyImageView(BP->device, texture.textureImageView, nullptr);
+	for (VkImageView view : levelViews) {
+		vkDestroyImageView(BP->device, view, nullptr);
+	}
+	vkDestroyImage(BP->device, image, nullptr);
+	BP->memoryAllocator.free(imageMemory);
+}
+
+void DepthPyramid::destroy() {
+	reduce.destroy();
+	if (BP->msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+		reduceMultisampled.destroy();
+	}
+	DSL.cleanup();
+}
+
+void UploadQueue::init(BaseProject* bp, VkDeviceSize stagingBudget) {
+	BP = bp;
+	QueueFamilyIndices indices = BP->findQueueFamilies(BP->physicalDevice);
+	graphicsFamily = indices.graphicsFamily.value();
+	dedicated = indices.transferFamily.has_value();
+	transferFamily = dedicated ? indices.transferFamily.value() : graphicsFamily;
+
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	poolInfo.queueFamilyIndex = graphicsFamily;
+	if (vkCreateCommandPool(BP->device, &poolInfo, nullptr, &graphicsPool) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create upload command pool!");
+	}
+	transferPool = graphicsPool;
+	if (dedicated) {
+		poolInfo.queueFamilyIndex = transferFamily;
+		if (vkCreateCommandPool(BP->device, &poolInfo, nullptr, &transferPool) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create upload command pool!");
+		}
+	}
+	open = Batch();
+	open.id = 1;
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+	ringAlignment = std::max<VkDeviceSize>(16, properties.limits.optimalBufferCopyOffsetAlignment);
+	ringSize = stagingBudget;
+	ringHead = ringTail = 0;
+	BP->createBuffer(ringSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		ringBuffer, ringMemory);
+
+	std::cout << "Uploads on " << (dedicated ? "a dedicated transfer queue" : "the graphics queue")
+		<< " through a " << (ringSize >> 20) << " MiB staging ring\n";
+}
+
+// Reserves size bytes of staging memory for the open batch
+UploadQueue::StagingRegion UploadQueue::stage(VkDeviceSize size) {
+	if (size > ringSize) {
+		StagingRegion region{ VK_NULL_HANDLE, 0, nullptr };
+		MemoryAllocation memory;
+		BP->createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			region.buffer, memory);
+		region.data = memory.mapped;
+		retire(region.buffer, memory);
+		return region;
+	}
+
+	for (;;) {
+		VkDeviceSize start = (ringHead + ringAlignment - 1) / ringAlignment * ringAlignment;
+		// A region never wraps around the end of the ring, it starts over at offset 0
+		if (start % ringSize + size > ringSize) {
+			start = (start / ringSize + 1) * ringSize;
+		}
+		if (start + size - ringTail <= ringSize) {
+			ringHead = start + size;
+			open.ringEnd = ringHead;
+			return { ringBuffer, start % ringSize, static_cast<char*>(ringMemory.mapped) + start % ringSize };
+		}
+		waitOldest();
+	}
+}
+
+// Frees ring space by waiting for the oldest batch, submitting the open one if it is the only one
+void UploadQueue::waitOldest() {
+	if (inFlight.empty()) {
+		flush();
+		if (inFlight.empty()) {
+			// Nothing was recorded, so nothing holds the ring
+			ringTail = ringHead;
+			return;
+		}
+	}
+	vkWaitForFences(BP->device, 1, &inFlight.front().done, VK_TRUE, UINT64_MAX);
+	collect();
+}
+
+VkCommandBuffer UploadQueue::begin(VkCommandPool pool, VkCommandBuffer& commandBuffer) {
+	if (commandBuffer != VK_NULL_HANDLE) {
+		return commandBuffer;
+	}
+	VkCommandBufferAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandPool = pool;
+	allocInfo.commandBufferCount = 1;
+	vkAllocateCommandBuffers(BP->device, &allocInfo, &commandBuffer);
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(commandBuffer, &beginInfo);
+	return commandBuffer;
+}
+
+// Without a transfer family both are the same command buffer
+VkCommandBuffer UploadQueue::transferCommands() {
+	return begin(transferPool, dedicated ? open.transfer : open.graphics);
+}
+
+VkCommandBuffer UploadQueue::graphicsCommands() {
+	return begin(graphicsPool, open.graphics);
+}
+
+// Makes the copies into a buffer visible to the graphics queue: a release and an acquire
+// when the queues differ, or a plain barrier
+void UploadQueue::handOverBuffer(VkBuffer buffer, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+	VkBufferMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = dstAccess;
+	barrier.srcQueueFamilyIndex = dedicated ? transferFamily : VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = dedicated ? graphicsFamily : VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = buffer;
+	barrier.offset = 0;
+	barrier.size = VK_WHOLE_SIZE;
+
+	if (!dedicated) {
+		vkCmdPipelineBarrier(graphicsCommands(), VK_PIPELINE_STAGE_TRANSFER_BIT, dstStage, 0,
+			0, nullptr, 1, &barrier, 0, nullptr);
+		return;
+	}
+	barrier.dstAccessMask = 0;
+	vkCmdPipelineBarrier(transferCommands(), VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = dstAccess;
+	vkCmdPipelineBarrier(graphicsCommands(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dstStage, 0,
+		0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+// Moves an image written on the transfer queue to the graphics queue in the same layout, for
+// more transfer work there; on a single queue the next barrier on the image is enough
+void UploadQueue::handOverImage(VkImage image, VkImageLayout layout, uint32_t mipLevels, int layerCount) {
+	if (!dedicated) {
+		return;
+	}
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout = layout;
+	barrier.newLayout = layout;
+	barrier.srcQueueFamilyIndex = transferFamily;
+	barrier.dstQueueFamilyIndex = graphicsFamily;
+	barrier.image = image;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.baseMipLevel = 0;
+	barrier.subresourceRange.levelCount = mipLevels;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = layerCount;
+
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = 0;
+	vkCmdPipelineBarrier(transferCommands(), VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+	vkCmdPipelineBarrier(graphicsCommands(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+// The staging buffer of a copy lives until the batch is done with it
+void UploadQueue::retire(VkBuffer buffer, MemoryAllocation& memory) {
+	open.staging.push_back({ buffer, memory });
+}
+
+// Submits the open batch, the copies first, and returns its number
+uint64_t UploadQueue::flush() {
+	if (open.transfer == VK_NULL_HANDLE && open.graphics == VK_NULL_HANDLE) {
+		return open.id - 1;
+	}
+
+	VkFenceCreateInfo fenceInfo{};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	vkCreateFence(BP->device, &fenceInfo, nullptr, &open.done);
+
+	VkSubmitInfo submitInfo{};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	if (open.transfer != VK_NULL_HANDLE) {
+		vkEndCommandBuffer(open.transfer);
+		submitInfo.pCommandBuffers = &open.transfer;
+		if (open.graphics != VK_NULL_HANDLE) {
+			VkSemaphoreCreateInfo semaphoreInfo{};
+			semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+			vkCreateSemaphore(BP->device, &semaphoreInfo, nullptr, &open.copied);
+			submitInfo.signalSemaphoreCount = 1;
+			submitInfo.pSignalSemaphores = &open.copied;
+		}
+		if (vkQueueSubmit(BP->transferQueue, 1, &submitInfo,
+			open.graphics != VK_NULL_HANDLE ? VK_NULL_HANDLE : open.done) != VK_SUCCESS) {
+			throw std::runtime_error("failed to submit upload command buffer!");
+		}
+	}
+	if (open.graphics != VK_NULL_HANDLE) {
+		VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+		vkEndCommandBuffer(open.graphics);
+		submitInfo = VkSubmitInfo{};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &open.graphics;
+		if (open.copied != VK_NULL_HANDLE) {
+			submitInfo.waitSemaphoreCount = 1;
+			submitInfo.pWaitSemaphores = &open.copied;
+			submitInfo.pWaitDstStageMask = &waitStage;
+		}
+		if (vkQueueSubmit(BP->graphicsQueue, 1, &submitInfo, open.done) != VK_SUCCESS) {
+			throw std::runtime_error("failed to submit upload command buffer!");
+		}
+	}
+
+	uint64_t id = open.id;
+	inFlight.push_back(open);
+	open = Batch();
+	open.id = id + 1;
+	return id;
+}
+
+void UploadQueue::release(Batch& batch) {
+	if (batch.ringEnd != 0) {
+		ringTail = batch.ringEnd;
+	}
+	for (auto& staging : batch.staging) {
+		vkDestroyBuffer(BP->device, staging.first, nullptr);
+		BP->memoryAllocator.free(staging.second);
+	}
+	if (batch.transfer != VK_NULL_HANDLE) {
+		vkFreeCommandBuffers(BP->device, transferPool, 1, &batch.transfer);
+	}
+	if (batch.graphics != VK_NULL_HANDLE) {
+		vkFreeCommandBuffers(BP->device, graphicsPool, 1, &batch.graphics);
+	}
+	if (batch.copied != VK_NULL_HANDLE) {
+		vkDestroySemaphore(BP->device, batch.copied, nullptr);
+	}
+	vkDestroyFence(BP->device, batch.done, nullptr);
+}
+
+// Releases the batches whose fence has signaled, without waiting. The ring is freed in order,
+// so a batch that finished early waits for the older ones.
+void UploadQueue::collect() {
+	size_t done = 0;
+	while (done < inFlight.size() && vkGetFenceStatus(BP->device, inFlight[done].done) == VK_SUCCESS) {
+		release(inFlight[done++]);
+	}
+	inFlight.erase(inFlight.begin(), inFlight.begin() + done);
+}
+
+// True once batch id and every batch before it have completed
+bool UploadQueue::isComplete(uint64_t id) {
+	collect();
+	if (id >= open.id) {
+		return false;
+	}
+	for (const Batch& batch : inFlight) {
+		if (batch.id <= id) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Blocks until batch id has completed, submitting it first if it is still open
+void UploadQueue::wait(uint64_t id) {
+	if (id >= open.id) {
+		flush();
+	}
+	for (Batch& batch : inFlight) {
+		if (batch.id <= id) {
+			vkWaitForFences(BP->device, 1, &batch.done, VK_TRUE, UINT64_MAX);
+		}
+	}
+	collect();
+}
+
+void UploadQueue::cleanup() {
+	wait(open.id);
+	vkDestroyBuffer(BP->device, ringBuffer, nullptr);
+	BP->memoryAllocator.free(ringMemory);
+	if (transferPool != graphicsPool) {
+		vkDestroyCommandPool(BP->device, transferPool, nullptr);
+	}
+	vkDestroyCommandPool(BP->device, graphicsPool, nullptr);
+}
+
 void DescriptorSetLayout::init(BaseProject* bp, std::vector<DescriptorSetLayoutBinding> B) {
 	BP = bp;
 
@@ -2819,11 +4229,18 @@ void DescriptorSet::init(BaseProject* bp, DescriptorSetLayout* DSL,
 	uniformBuffers.resize(E.size());
 	uniformBuffersMemory.resize(E.size());
 	toFree.resize(E.size());
+	ringOffsets.assign(E.size(), 0);
+	dynamicElements.clear();
 
 	for (int j = 0; j < E.size(); j++) {
 		uniformBuffers[j].resize(BP->swapChainImages.size());
 		uniformBuffersMemory[j].resize(BP->swapChainImages.size());
-		if (E[j].type == UNIFORM) {
+		if (E[j].type == UNIFORM_DYNAMIC) {
+			ringOffsets[j] = BP->uniformRing.allocate(E[j].size);
+			dynamicElements.push_back(j);
+			toFree[j] = false;
+		}
+		else if (E[j].type == UNIFORM) {
 			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
 				VkDeviceSize bufferSize = E[j].size;
 				BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
@@ -2838,6 +4255,11 @@ void DescriptorSet::init(BaseProject* bp, DescriptorSetLayout* DSL,
 		}
 	}
 
+	// Dynamic offsets are consumed in binding order
+	std::sort(dynamicElements.begin(), dynamicElements.end(), [&](int a, int b) {
+		return E[a].binding < E[b].binding;
+	});
+
 	std::vector<VkDescriptorSetLayout> layouts(BP->swapChainImages.size(),
 		DSL->descriptorSetLayout);
 	VkDescriptorSetAllocateInfo allocInfo{};
@@ -2873,6 +4295,32 @@ void DescriptorSet::init(BaseProject* bp, DescriptorSetLayout* DSL,
 				descriptorWrites[j].descriptorCount = 1;
 				descriptorWrites[j].pBufferInfo = &bufferInfo[j];
 			}
+			else if (E[j].type == UNIFORM_DYNAMIC) {
+				bufferInfo[j].buffer = BP->uniformRing.buffer;
+				bufferInfo[j].offset = 0;
+				bufferInfo[j].range = E[j].size;
+
+				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+				descriptorWrites[j].dstSet = descriptorSets[i];
+				descriptorWrites[j].dstBinding = E[j].binding;
+				descriptorWrites[j].dstArrayElement = 0;
+				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+				descriptorWrites[j].descriptorCount = 1;
+				descriptorWrites[j].pBufferInfo = &bufferInfo[j];
+			}
+			else if (E[j].type == STORAGE) {
+				bufferInfo[j].buffer = E[j].inst ? E[j].inst->buffers[i] : E[j].buf->buffer;
+				bufferInfo[j].offset = 0;
+				bufferInfo[j].range = E[j].inst ? E[j].inst->size : E[j].buf->size;
+
+				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+				descriptorWrites[j].dstSet = descriptorSets[i];
+				descriptorWrites[j].dstBinding = E[j].binding;
+				descriptorWrites[j].dstArrayElement = 0;
+				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+				descriptorWrites[j].descriptorCount = 1;
+				descriptorWrites[j].pBufferInfo = &bufferInfo[j];
+			}
 			else if (E[j].type == TEXTURE) {
 				imageInfo[j].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 				imageInfo[j].imageView = E[j].tex->textureImageView;
@@ -2899,7 +4347,7 @@ void DescriptorSet::cleanup() {
 		if (toFree[j]) {
 			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
 				vkDestroyBuffer(BP->device, uniformBuffers[j][i], nullptr);
-				vkFreeMemory(BP->device, uniformBuffersMemory[j][i], nullptr);
+				BP->memoryAllocator.free(uniformBuffersMemory[j][i]);
 			}
 		}
 	}
@@ -2907,17 +4355,37 @@ void DescriptorSet::cleanup() {
 
 void DescriptorSet::bind(VkCommandBuffer commandBuffer, Pipeline& P, int setId,
 	int currentImage) {
+	std::vector<uint32_t> offsets = dynamicOffsets(currentImage);
 	vkCmdBindDescriptorSets(commandBuffer,
 		VK_PIPELINE_BIND_POINT_GRAPHICS,
 		P.pipelineLayout, setId, 1, &descriptorSets[currentImage],
-		0, nullptr);
+		static_cast<uint32_t>(offsets.size()), offsets.data());
+}
+
+void DescriptorSet::bind(VkCommandBuffer commandBuffer, ComputePipeline& P, int setId,
+	int currentImage) {
+	std::vector<uint32_t> offsets = dynamicOffsets(currentImage);
+	vkCmdBindDescriptorSets(commandBuffer,
+		VK_PIPELINE_BIND_POINT_COMPUTE,
+		P.pipelineLayout, setId, 1, &descriptorSets[currentImage],
+		static_cast<uint32_t>(offsets.size()), offsets.data());
+}
+
+// Offsets of the slices of the current image, for the UNIFORM_DYNAMIC elements in binding order
+std::vector<uint32_t> DescriptorSet::dynamicOffsets(int currentImage) {
+	std::vector<uint32_t> offsets;
+	for (int j : dynamicElements) {
+		offsets.push_back(BP->uniformRing.dynamicOffset(currentImage, ringOffsets[j]));
+	}
+	return offsets;
 }
 
 void DescriptorSet::map(int currentImage, void* src, int size, int slot) {
-	void* data;
+	// Slices of the uniform ring are mapped once, a copy is all it takes
+	if (std::find(dynamicElements.begin(), dynamicElements.end(), slot) != dynamicElements.end()) {
+		BP->uniformRing.write(currentImage, ringOffsets[slot], src, size);
+		return;
+	}
 
-	vkMapMemory(BP->device, uniformBuffersMemory[slot][currentImage], 0,
-		size, 0, &data);
-	memcpy(data, src, size);
-	vkUnmapMemory(BP->device, uniformBuffersMemory[slot][currentImage]);
+	memcpy(uniformBuffersMemory[slot][currentImage].mapped, src, size);
 }
\ No newline at end of file
@@ -0,0 +1,117 @@
+// ThreadPool.hpp
+// Persistent worker threads for the data-parallel simulation passes.
+// parallelFor splits an index range in chunks that the workers and the calling
+// thread pick up until the range is exhausted, then returns once all are done.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+    // The calling thread also works, so 'threads' counts it
+    explicit ThreadPool(unsigned threads = std::thread::hardware_concurrency()) {
+        threads = std::max(threads, 1u);
+        for (unsigned i = 1; i < threads; i++) {
+            workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& t : workers) {
+            t.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const {
+        return (int)workers.size() + 1;
+    }
+
+    // Calls fn(begin, end) on chunks of at most 'grain' indices covering [0, count).
+    // Only one thread may issue parallelFor calls on a pool at a time.
+    void parallelFor(int count, int grain, const std::function<void(int, int)>& fn) {
+        if (count <= 0) {
+            return;
+        }
+        grain = std::max(grain, 1);
+        if (workers.empty() || count <= grain) {
+            fn(0, count);
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        job = &fn;
+        jobCount = count;
+        jobGrain = grain;
+        next = 0;
+        busy = (int)workers.size();
+        generation++;
+        lock.unlock();
+        wake.notify_all();
+
+        runChunks();
+
+        lock.lock();
+        done.wait(lock, [this] { return busy == 0; });
+        job = nullptr;
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    bool stopping = false;
+    uint64_t generation = 0;
+    int busy = 0;
+
+    const std::function<void(int, int)>* job = nullptr;
+    int jobCount = 0;
+    int jobGrain = 1;
+    std::atomic<int> next{ 0 };
+
+    void runChunks() {
+        for (;;) {
+            int begin = next.fetch_add(jobGrain);
+            if (begin >= jobCount) {
+                return;
+            }
+            (*job)(begin, std::min(begin + jobGrain, jobCount));
+        }
+    }
+
+    void workerLoop() {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+
+            runChunks();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0) {
+                done.notify_one();
+            }
+        }
+    }
+};
@@ -0,0 +1,162 @@
+// TrajectoryExport.hpp
+// Streams the trajectories of every body of a SolarSystemEphemeris to a columnar binary file.
+// The time range is cut into blocks of consecutive timestamps; the workers of a ThreadPool
+// propagate and encode a bounded number of blocks at a time, and the blocks are appended in
+// time order, so memory use does not depend on the length of the range.
+//
+// File layout, all values little endian:
+//   char[4]  "TRAJ"
+//   uint32   version (1)
+//   uint32   flags (bit 0: columns are compressed)
+//   uint32   number of bodies B
+//   uint64   number of timestamps
+//   double   first timestamp
+//   double   time step
+//   uint32   timestamps per block
+//   B times: uint32 name length, name bytes
+//   blocks:  uint32 timestamps in the block T, then 3 * B columns (body 0 x, y, z, body 1 x, ...),
+//            each one uint32 byte length followed by T floats of heliocentric position.
+// Compressed columns hold the four byte planes of the T floats one after the other (the
+// slowly varying sign and exponent bytes end up next to each other), raw deflated with sdefl.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "SolarSystemEphemeris.hpp"
+#include "ThreadPool.hpp"
+
+#define SDEFL_IMPLEMENTATION
+#include <sdefl.h>
+
+struct TrajectoryExport {
+    static constexpr uint32_t VERSION = 1;
+    static constexpr uint32_t FLAG_COMPRESSED = 1;
+    // Blocks encoded per worker before they are written out
+    static const int BLOCKS_PER_WORKER = 2;
+
+    int blockSize = 4096;
+    bool compress = false;
+    bool keplerian = true;
+
+    // Summary of the last export
+    uint64_t bytesWritten = 0;
+    uint64_t rawBytes = 0;
+
+    void run(const SolarSystemEphemeris& model, const std::string& path,
+        double start, double end, double step, ThreadPool& pool) {
+        if (!(step > 0.0) || end < start) {
+            throw std::runtime_error("Trajectory export needs start <= end and a positive step");
+        }
+        std::ofstream file(path, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("Failed to open " + path);
+        }
+
+        const int bodies = model.bodyCount();
+        const uint64_t times = (uint64_t)((end - start) / step) + 1;
+        const uint64_t blocks = (times + blockSize - 1) / blockSize;
+        rawBytes = times * bodies * 3 * sizeof(float);
+
+        file.write("TRAJ", 4);
+        writeValue(file, VERSION);
+        writeValue(file, compress ? FLAG_COMPRESSED : 0u);
+        writeValue(file, (uint32_t)bodies);
+        writeValue(file, times);
+        writeValue(file, start);
+        writeValue(file, step);
+        writeValue(file, (uint32_t)blockSize);
+        for (const std::string& name : model.names) {
+            writeValue(file, (uint32_t)name.size());
+            file.write(name.data(), name.size());
+        }
+
+        // One slot per block in flight, each reused by the wave after it
+        const int wave = pool.size() * BLOCKS_PER_WORKER;
+        std::vector<std::vector<uint8_t>> encoded(wave);
+
+        for (uint64_t first = 0; first < blocks; first += wave) {
+            int inWave = (int)std::min<uint64_t>(wave, blocks - first);
+            pool.parallelFor(inWave, 1, [&](int begin, int end) {
+                std::vector<double> t;
+                std::vector<float> positions, column;
+                std::vector<uint8_t> planes;
+                sdefl* deflater = compress ? new sdefl() : nullptr;
+                for (int w = begin; w < end; w++) {
+                    uint64_t block = first + w;
+                    uint64_t t0 = block * blockSize;
+                    int count = (int)std::min<uint64_t>(blockSize, times - t0);
+                    t.resize(count);
+                    for (int m = 0; m < count; m++) {
+                        t[m] = start + (double)(t0 + m) * step;
+                    }
+                    positions.resize((size_t)count * bodies * 3);
+                    model.positions(t.data(), count, positions.data(), keplerian);
+
+                    std::vector<uint8_t>& out = encoded[w];
+                    out.clear();
+                    appendValue(out, (uint32_t)count);
+                    column.resize(count);
+                    for (int c = 0; c < bodies * 3; c++) {
+                        for (int m = 0; m < count; m++) {
+                            column[m] = positions[(size_t)m * bodies * 3 + c];
+                        }
+                        if (deflater) {
+                            appendCompressed(out, column, planes, deflater);
+                        }
+                        else {
+                            appendValue(out, (uint32_t)(count * sizeof(float)));
+                            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(column.data());
+                            out.insert(out.end(), bytes, bytes + count * sizeof(float));
+                        }
+                    }
+                }
+                delete deflater;
+            });
+
+            for (int w = 0; w < inWave; w++) {
+                file.write(reinterpret_cast<const char*>(encoded[w].data()), encoded[w].size());
+            }
+            if (!file) {
+                throw std::runtime_error("Failed to write " + path);
+            }
+        }
+        bytesWritten = (uint64_t)file.tellp();
+    }
+
+private:
+    template <class T>
+    static void writeValue(std::ofstream& file, const T& value) {
+        file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <class T>
+    static void appendValue(std::vector<uint8_t>& out, const T& value) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+        out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+
+    static void appendCompressed(std::vector<uint8_t>& out, const std::vector<float>& column,
+        std::vector<uint8_t>& planes, sdefl* deflater) {
+        size_t n = column.size();
+        planes.resize(n * sizeof(float));
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(column.data());
+        for (size_t m = 0; m < n; m++) {
+            for (int p = 0; p < (int)sizeof(float); p++) {
+                planes[p * n + m] = bytes[m * sizeof(float) + p];
+            }
+        }
+
+        size_t header = out.size();
+        out.resize(header + sizeof(uint32_t) + sdefl_bound((int)planes.size()));
+        int length = sdeflate(deflater, out.data() + header + sizeof(uint32_t),
+            planes.data(), (int)planes.size(), SDEFL_LVL_DEF);
+        uint32_t length32 = (uint32_t)length;
+        memcpy(out.data() + header, &length32, sizeof(uint32_t));
+        out.resize(header + sizeof(uint32_t) + length);
+    }
+};
@@ -0,0 +1,21 @@
+// Asteroid.frag
+#version 450
+
+layout(location = 0) in vec3 fragNormal;
+layout(location = 1) in vec3 fragPos;
+
+layout(location = 0) out vec4 outColor;
+
+layout(binding = 0) uniform UniformBufferObject {
+    mat4 viewProj;
+    vec3 lightPos;
+    float time;
+    float timeLow;
+} ubo;
+
+void main() {
+    vec3 lightDir = normalize(ubo.lightPos - fragPos);
+    float diffuse = max(dot(normalize(fragNormal), lightDir), 0.0);
+    vec3 rockColor = vec3(0.55, 0.5, 0.45);
+    outColor = vec4(rockColor * (0.15 + 0.85 * diffuse), 1.0);
+}
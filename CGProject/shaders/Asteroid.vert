@@ -0,0 +1,24 @@
+// Asteroid.vert
+#version 450
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec2 inTexCoord;
+layout(location = 2) in vec3 inNormal;
+layout(location = 3) in vec4 inInstance;   // xyz: position, w: size
+
+layout(location = 0) out vec3 fragNormal;
+layout(location = 1) out vec3 fragPos;
+
+layout(binding = 0) uniform UniformBufferObject {
+    mat4 viewProj;
+    vec3 lightPos;
+    float time;
+    float timeLow;
+} ubo;
+
+void main() {
+    vec3 worldPos = inInstance.xyz + inInstance.w * inPosition;
+    gl_Position = ubo.viewProj * vec4(worldPos, 1.0);
+    fragNormal = inNormal;
+    fragPos = worldPos;
+}
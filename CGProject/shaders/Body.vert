@@ -0,0 +1,46 @@
+// Body.vert
+// Sun, planets, moon and Saturn's ring with the split uniform layout: the camera and
+// the light come from the frame set, bound once per frame, and only the model and
+// normal matrices from the set of each object.
+#version 450
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec2 inTexCoord;
+#ifdef PACKED_NORMALS
+// Octahedral normal of the packed vertex layout, unfolded back onto the unit sphere
+layout(location = 2) in vec2 inPackedNormal;
+
+vec3 octDecode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+#define inNormal octDecode(inPackedNormal)
+#else
+layout(location = 2) in vec3 inNormal;
+#endif
+
+layout(location = 0) out vec2 fragTexCoord;
+layout(location = 1) out vec3 fragNormal;
+layout(location = 2) out vec3 fragPos;
+
+layout(set = 0, binding = 0) uniform FrameUniformBlock {
+    mat4 view;
+    mat4 proj;
+    vec3 lightPos;
+} frame;
+
+layout(set = 1, binding = 0) uniform ObjectUniformBlock {
+    mat4 model;
+    mat4 normal;    // Inverse transpose of the model matrix, computed once per object on the CPU
+    uvec4 material;
+} object;
+
+void main() {
+    vec4 worldPos = object.model * vec4(inPosition, 1.0);
+    gl_Position = frame.proj * frame.view * worldPos;
+    fragTexCoord = inTexCoord;
+    fragNormal = mat3(object.normal) * inNormal;
+    fragPos = worldPos.xyz;
+}
@@ -3,7 +3,20 @@
 
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec2 inTexCoord;
+#ifdef PACKED_NORMALS
+// Octahedral normal of the packed vertex layout, unfolded back onto the unit sphere
+layout(location = 2) in vec2 inPackedNormal;
+
+vec3 octDecode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+#define inNormal octDecode(inPackedNormal)
+#else
 layout(location = 2) in vec3 inNormal;
+#endif
 
 layout(location = 0) out vec2 fragTexCoord;
 layout(location = 1) out vec3 fragNormal;
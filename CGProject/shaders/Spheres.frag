@@ -0,0 +1,60 @@
+// Spheres.frag
+// Lit bodies as in SolarSystem.frag, the emissive sun as in Sun.frag, with every
+// texture in one layer of a 2D array.
+#version 450
+
+layout(location = 0) in vec2 fragTexCoord;
+layout(location = 1) in vec3 fragNormal;
+layout(location = 2) in vec3 fragPos;
+layout(location = 3) flat in uvec2 fragMaterial;
+
+layout(location = 0) out vec4 outColor;
+
+layout(binding = 0) uniform UniformBufferObject {
+    mat4 view;
+    mat4 proj;
+    vec3 lightPos;
+} ubo;
+
+layout(binding = 1) uniform sampler2DArray texSampler;
+
+vec4 sunColor() {
+    // Extend the UV coordinates to create a larger sun
+    vec2 extendedUV = (fragTexCoord - 0.5) * 1.5 + 0.5;
+    vec4 texColor = texture(texSampler, vec3(extendedUV, float(fragMaterial.x)));
+    float dist = length(extendedUV - vec2(0.5, 0.5));
+
+    // Orange glow, bright edge and aura
+    float glow = 1.0 - smoothstep(0.0, 0.75, dist);
+    vec3 finalColor = mix(texColor.rgb, vec3(1.0, 0.3, 0.0), glow * 0.8);
+    float edge = 1.0 - smoothstep(0.6, 0.75, dist);
+    finalColor += vec3(1.0, 0.5, 0.1) * edge * 0.6;
+    float auraIntensity = smoothstep(0.75, 1.5, dist);
+    finalColor = mix(finalColor, vec3(1.0, 0.6, 0.2), auraIntensity * 0.7);
+    finalColor *= 1.6;
+
+    // Color variation to simulate the solar surface
+    float noise = fract(sin(dot(extendedUV, vec2(12.9898, 78.233))) * 43758.5453);
+    finalColor += vec3(0.15, 0.05, 0.0) * noise * (1.0 - auraIntensity);
+    finalColor = min(finalColor, vec3(1.0));
+    finalColor *= vec3(1.0, 0.85, 0.7);
+
+    float alpha = 1.0 - smoothstep(0.75, 1.5, dist);
+    alpha = smoothstep(0.0, 0.2, alpha);
+    return vec4(finalColor, alpha);
+}
+
+void main() {
+    if (fragMaterial.y != 0u) {
+        outColor = sunColor();
+        return;
+    }
+
+    vec3 norm = normalize(fragNormal);
+    vec3 lightDir = normalize(ubo.lightPos - fragPos);
+
+    // Ambient plus Lambert diffuse light
+    vec3 lighting = 0.1 * vec3(1.0) + max(dot(norm, lightDir), 0.0) * vec3(1.0);
+    vec3 texColor = texture(texSampler, vec3(fragTexCoord, float(fragMaterial.x))).rgb;
+    outColor = vec4(lighting * texColor, 1.0);
+}
@@ -0,0 +1,43 @@
+// Spheres.vert
+// Sun, planets and moons in one instanced draw: the model matrix and the texture
+// layer of every body come from the per-instance vertex buffer.
+#version 450
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec2 inTexCoord;
+#ifdef PACKED_NORMALS
+// Octahedral normal of the packed vertex layout, unfolded back onto the unit sphere
+layout(location = 2) in vec2 inPackedNormal;
+
+vec3 octDecode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+#define inNormal octDecode(inPackedNormal)
+#else
+layout(location = 2) in vec3 inNormal;
+#endif
+layout(location = 3) in mat4 inModel;      // Locations 3 to 6
+layout(location = 7) in uvec2 inMaterial;  // x: texture layer, y: 1 for the emissive sun
+
+layout(location = 0) out vec2 fragTexCoord;
+layout(location = 1) out vec3 fragNormal;
+layout(location = 2) out vec3 fragPos;
+layout(location = 3) flat out uvec2 fragMaterial;
+
+layout(binding = 0) uniform UniformBufferObject {
+    mat4 view;
+    mat4 proj;
+    vec3 lightPos;
+} ubo;
+
+void main() {
+    vec4 worldPos = inModel * vec4(inPosition, 1.0);
+    gl_Position = ubo.proj * ubo.view * worldPos;
+    fragTexCoord = inTexCoord;
+    fragNormal = mat3(transpose(inverse(inModel))) * inNormal;
+    fragPos = worldPos.xyz;
+    fragMaterial = inMaterial;
+}
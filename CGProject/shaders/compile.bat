@@ -0,0 +1,15 @@
+@echo off
+rem Compiles every shader to the SPIR-V file the simulator loads, with glslc from the Vulkan SDK.
+rem Features set to "auto" in solarSystemData.json turn on once their shaders are compiled.
+setlocal
+cd /d "%~dp0"
+
+for %%f in (*.vert) do glslc %%f -o %%~nfVert.spv || exit /b 1
+for %%f in (*.frag) do glslc %%f -o %%~nfFrag.spv || exit /b 1
+for %%f in (*.comp) do glslc %%f -o %%~nfComp.spv || exit /b 1
+
+rem Depth pyramid reduction reading a multisampled depth buffer
+glslc -DMULTISAMPLED DepthPyramid.comp -o DepthPyramidMSComp.spv || exit /b 1
+
+rem Vertex shaders of the packed vertex layout, reading octahedral normals
+for %%n in (SolarSystem Sun Body Spheres) do glslc -DPACKED_NORMALS %%n.vert -o %%nPackedVert.spv || exit /b 1
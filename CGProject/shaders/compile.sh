@@ -0,0 +1,23 @@
+#!/bin/sh
+# Compiles every shader to the SPIR-V file the simulator loads, with glslc from the Vulkan SDK.
+# Features set to "auto" in solarSystemData.json turn on once their shaders are compiled.
+set -e
+cd "$(dirname "$0")"
+
+for f in *.vert *.frag *.comp; do
+    name="${f%.*}"
+    case "$f" in
+        *.vert) stage=Vert ;;
+        *.frag) stage=Frag ;;
+        *.comp) stage=Comp ;;
+    esac
+    glslc "$f" -o "$name$stage.spv"
+done
+
+# Depth pyramid reduction reading a multisampled depth buffer
+glslc -DMULTISAMPLED DepthPyramid.comp -o DepthPyramidMSComp.spv
+
+# Vertex shaders of the packed vertex layout, reading octahedral normals
+for name in SolarSystem Sun Body Spheres; do
+    glslc -DPACKED_NORMALS "$name.vert" -o "${name}PackedVert.spv"
+done